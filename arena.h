@@ -0,0 +1,106 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+/**
+ * @brief tiny spin lock, the critical sections guarded by it are a few
+ * instructions long (bump a pointer / push a block)
+ */
+class SpinLock {
+  private:
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+  public:
+    void lock() {
+        while (flag.test_and_set(std::memory_order_acquire)) {
+            while (flag.test(std::memory_order_relaxed)) {
+            }
+        }
+    }
+    void unlock() { flag.clear(std::memory_order_release); }
+};
+/**
+ * @brief bump-pointer allocator owned by a memtable. Memory handed out by the
+ * arena is never freed one by one, all blocks are released together when the
+ * arena is destroyed (e.g. when a flushed memtable is dropped).
+ * NOTE: allocate/allocateAligned can be called by many writers at once
+ */
+class Arena {
+  private:
+    static constexpr size_t block_size = 4096;
+    SpinLock lock;
+    char *alloc_ptr;
+    size_t alloc_remaining;
+    std::atomic<size_t> memory_usage;
+    std::vector<std::unique_ptr<char[]>> blocks;
+
+    char *allocateNewBlock(size_t block_bytes) {
+        blocks.emplace_back(new char[block_bytes]);
+        memory_usage.fetch_add(block_bytes + sizeof(char *),
+                               std::memory_order_relaxed);
+        return blocks.back().get();
+    }
+    char *allocateFallback(size_t bytes) {
+        if (bytes > block_size / 4) {
+            // NOTE: big object gets its own block so the rest of the current
+            // block is not wasted
+            return allocateNewBlock(bytes);
+        }
+        alloc_ptr = allocateNewBlock(block_size);
+        alloc_remaining = block_size;
+        char *result = alloc_ptr;
+        alloc_ptr += bytes;
+        alloc_remaining -= bytes;
+        return result;
+    }
+
+  public:
+    Arena() : alloc_ptr(nullptr), alloc_remaining(0), memory_usage(0) {}
+    Arena(const Arena &other) = delete;
+    Arena &operator=(const Arena &other) = delete;
+    ~Arena() = default;
+
+    /**
+    @brief allocate bytes without alignment guarantee (e.g. value bytes)
+     */
+    char *allocate(size_t bytes) {
+        std::lock_guard<SpinLock> guard(lock);
+        if (bytes <= alloc_remaining) [[likely]] {
+            char *result = alloc_ptr;
+            alloc_ptr += bytes;
+            alloc_remaining -= bytes;
+            return result;
+        }
+        return allocateFallback(bytes);
+    }
+    /**
+    @brief allocate bytes aligned to pointer size (e.g. skiplist nodes)
+     */
+    char *allocateAligned(size_t bytes) {
+        constexpr size_t align = alignof(std::max_align_t) > sizeof(void *)
+                                     ? alignof(std::max_align_t)
+                                     : sizeof(void *);
+        static_assert((align & (align - 1)) == 0, "align must be power of 2");
+        std::lock_guard<SpinLock> guard(lock);
+        size_t mod = reinterpret_cast<uintptr_t>(alloc_ptr) & (align - 1);
+        size_t slop = mod == 0 ? 0 : align - mod;
+        size_t needed = bytes + slop;
+        if (needed <= alloc_remaining) [[likely]] {
+            char *result = alloc_ptr + slop;
+            alloc_ptr += needed;
+            alloc_remaining -= needed;
+            return result;
+        }
+        // HINT: new[] returns memory aligned to max_align_t
+        return allocateFallback(bytes);
+    }
+    [[nodiscard]] size_t memoryUsage() const {
+        return memory_usage.load(std::memory_order_relaxed);
+    }
+};
+#endif
@@ -0,0 +1,142 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+/**
+ * @brief LRU cache with a byte budget, split into shards by the key hash so
+ * concurrent readers rarely meet on the same mutex. Every entry is charged
+ * by the caller, an entry is evicted when its shard is over capacity / shards.
+ * NOTE: values are handed out as shared_ptr, an evicted value stays valid for
+ * the readers still holding it
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class ShardedLRUCache {
+  public:
+    using Handle = std::shared_ptr<const Value>;
+
+  private:
+    struct Entry {
+        Key key;
+        Handle value;
+        size_t charge;
+    };
+    struct Shard {
+        std::mutex mtx;
+        std::list<Entry> lru; // NOTE: most recently used at the front
+        std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> map;
+        size_t usage = 0;
+    };
+    std::vector<Shard> shards;
+    std::atomic<size_t> capacity;
+    std::atomic<uint64_t> hit_num;
+    std::atomic<uint64_t> miss_num;
+    Hash hasher;
+
+    Shard &shardOf(const Key &key) {
+        return shards[hasher(key) % shards.size()];
+    }
+    size_t shardCapacity() const {
+        return capacity.load(std::memory_order_relaxed) / shards.size();
+    }
+    void evict(Shard &shard, size_t limit) {
+        while (shard.usage > limit && !shard.lru.empty()) {
+            auto &victim = shard.lru.back();
+            shard.usage -= victim.charge;
+            shard.map.erase(victim.key);
+            shard.lru.pop_back();
+        }
+    }
+
+  public:
+    explicit ShardedLRUCache(size_t capacity, size_t shard_num = 16)
+        : shards(shard_num == 0 ? 1 : shard_num), capacity(capacity),
+          hit_num(0), miss_num(0) {}
+    ShardedLRUCache(const ShardedLRUCache &other) = delete;
+    ShardedLRUCache &operator=(const ShardedLRUCache &other) = delete;
+
+    /**
+    @brief find the value and mark it recently used
+     * @return Handle nullptr if not cached
+     */
+    Handle lookup(const Key &key) {
+        auto &shard = shardOf(key);
+        std::lock_guard lock(shard.mtx);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end()) {
+            miss_num.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        hit_num.fetch_add(1, std::memory_order_relaxed);
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return it->second->value;
+    }
+    /**
+    @brief insert (or replace) the value, evict the least recently used ones
+    if the shard is over budget
+     * @param  charge the bytes the value takes
+     */
+    void insert(const Key &key, Handle value, size_t charge) {
+        auto limit = shardCapacity();
+        if (charge > limit) {
+            // HINT: also covers a disabled cache (capacity 0)
+            return;
+        }
+        auto &shard = shardOf(key);
+        std::lock_guard lock(shard.mtx);
+        auto it = shard.map.find(key);
+        if (it != shard.map.end()) {
+            shard.usage -= it->second->charge;
+            shard.lru.erase(it->second);
+            shard.map.erase(it);
+        }
+        shard.lru.push_front({key, std::move(value), charge});
+        shard.map.emplace(key, shard.lru.begin());
+        shard.usage += charge;
+        evict(shard, limit);
+    }
+    void setCapacity(size_t new_capacity) {
+        capacity.store(new_capacity, std::memory_order_relaxed);
+        auto limit = shardCapacity();
+        for (auto &shard : shards) {
+            std::lock_guard lock(shard.mtx);
+            evict(shard, limit);
+        }
+    }
+    void clear() {
+        for (auto &shard : shards) {
+            std::lock_guard lock(shard.mtx);
+            evict(shard, 0);
+        }
+    }
+    [[nodiscard]] size_t usage() {
+        size_t total = 0;
+        for (auto &shard : shards) {
+            std::lock_guard lock(shard.mtx);
+            total += shard.usage;
+        }
+        return total;
+    }
+    [[nodiscard]] size_t getCapacity() const {
+        return capacity.load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t hits() const {
+        return hit_num.load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t misses() const {
+        return miss_num.load(std::memory_order_relaxed);
+    }
+    void resetStats() {
+        hit_num.store(0, std::memory_order_relaxed);
+        miss_num.store(0, std::memory_order_relaxed);
+    }
+};
+#endif
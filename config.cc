@@ -5,6 +5,25 @@ int bf_default_k = 3;
 u64 bf_default_size = 8 * 1024 * 8; // 8KB = 8*8*1024 bit
 bool use_bf = true;
 bool use_cache = true;
+size_t max_immutable_num = 2;
+size_t compaction_threads = 2;
+size_t l0_stop_num = 8;
+size_t max_subcompactions = 4;
+size_t subcompaction_min_entries = 2048;
+bool lazy_load = false;
+bool mmap_sst = false;
+size_t fence_interval = 64;
+size_t eytzinger_min_keys = 64 * 1024;
+size_t block_cache_size = 8 * 1024 * 1024;
+size_t value_cache_size = 0;
+size_t inline_value_size = 0;
+size_t vlog_segment_size = 0;
+double gc_dead_ratio = 0;
+size_t gc_region_size = 1024 * 1024;
+size_t gc_interval_ms = 1000;
+SyncMode sync_mode = SyncMode::none;
+size_t sync_interval_ms = 100;
+size_t sync_bytes = 4 * 1024 * 1024;
 std::ostream &operator<<(std::ostream &os, const ConfigParam &conf) {
   auto out_format = "use_bf: %s, use_cache: %s\nbf_size: %d, bf_func_num: %d\n";
   char out[256];
@@ -15,6 +34,31 @@ std::ostream &operator<<(std::ostream &os, const ConfigParam &conf) {
   os << out;
   return os;
 }
+Snapshot::~Snapshot() {
+  config::bf_default_k = bf_default_k;
+  config::bf_default_size = bf_default_size;
+  config::use_bf = use_bf;
+  config::use_cache = use_cache;
+  config::max_immutable_num = max_immutable_num;
+  config::compaction_threads = compaction_threads;
+  config::l0_stop_num = l0_stop_num;
+  config::max_subcompactions = max_subcompactions;
+  config::subcompaction_min_entries = subcompaction_min_entries;
+  config::lazy_load = lazy_load;
+  config::fence_interval = fence_interval;
+  config::mmap_sst = mmap_sst;
+  config::eytzinger_min_keys = eytzinger_min_keys;
+  config::block_cache_size = block_cache_size;
+  config::value_cache_size = value_cache_size;
+  config::inline_value_size = inline_value_size;
+  config::vlog_segment_size = vlog_segment_size;
+  config::gc_dead_ratio = gc_dead_ratio;
+  config::gc_region_size = gc_region_size;
+  config::gc_interval_ms = gc_interval_ms;
+  config::sync_mode = sync_mode;
+  config::sync_interval_ms = sync_interval_ms;
+  config::sync_bytes = sync_bytes;
+}
 void reConfig(const config::ConfigParam &newConfig) {
   auto [bf_default_size, bf_default_k, use_bf, use_cache] = newConfig;
   if (!use_cache) {
@@ -7,6 +7,94 @@ extern int bf_default_k;
 extern uint64_t bf_default_size; // 8KB = 8*8*1024 bit
 extern bool use_bf;
 extern bool use_cache;
+// NOTE: writers stall when this many immutable memtables wait to be flushed
+extern size_t max_immutable_num;
+// NOTE: background threads merging the levels
+extern size_t compaction_threads;
+// NOTE: the flush thread stalls when level 0 has this many SSTables
+extern size_t l0_stop_num;
+// NOTE: a merge of at least subcompaction_min_entries kEntrys is split into
+// up to max_subcompactions key-range shards merged in parallel
+extern size_t max_subcompactions;
+extern size_t subcompaction_min_entries;
+// NOTE: load SSTables lazily, only the header, the BF and a fence index (the
+// key of every fence_interval-th kEntry) stay in memory
+extern bool lazy_load;
+extern size_t fence_interval;
+// NOTE: lazy loading through a read-only mmap of each SSTable file, the
+// blocks are read from the mapping (the page cache) instead of by pread
+extern bool mmap_sst;
+// NOTE: the key index of an in-memory SSTable with at least this many kEntrys
+// is kept in Eytzinger order (fewer cache misses per lookup on big tables),
+// a smaller one as a sorted array
+extern size_t eytzinger_min_keys;
+// NOTE: bytes of the LRU cache holding the key blocks of lazy SSTables
+extern size_t block_cache_size;
+// NOTE: bytes of the LRU cache of vlog values (by offset), 0 disables it
+extern size_t value_cache_size;
+// NOTE: a value of at most inline_value_size bytes is stored in the offset
+// field of its SSTable kEntry when the memtable is flushed, get and scan then
+// never read the vlog for it. 0 disables it, more than sizeof(TOff) is
+// rejected by the KVStore constructor
+extern size_t inline_value_size;
+// NOTE: split the vlog into segment files of about this many bytes, gc
+// deletes whole segments. 0 keeps the single hole-punched vlog file
+extern size_t vlog_segment_size;
+// NOTE: background gc. Dead vlog bytes are counted by region of
+// gc_region_size bytes, every gc_interval_ms the tail regions are collected
+// once their dead ratio reaches gc_dead_ratio. 0 (the default) starts no gc
+// thread, the vlog is then only collected by gc() calls
+extern double gc_dead_ratio;
+extern size_t gc_region_size;
+extern size_t gc_interval_ms;
+/**
+ * @brief when written data is forced to the disk
+ * none: left to the page cache, a crash of the machine may lose it
+ * batch: a put returns once its vlog entry is synced (the vlog is the
+ * write-ahead log), the puts that arrive together share one write and one
+ * fdatasync (group commit). Every saved SSTable is synced
+ * periodic: a background thread fdatasyncs the vlog every sync_interval_ms,
+ * or earlier once sync_bytes are unsynced. SSTables are synced on save
+ */
+enum class SyncMode { none, batch, periodic };
+extern SyncMode sync_mode;
+extern size_t sync_interval_ms;
+extern size_t sync_bytes;
+/**
+ * @brief a copy of every knob above, put back when it goes out of scope. A
+ * test holds one, so the knobs it changes are restored however it ends
+ */
+class Snapshot {
+  int bf_default_k = config::bf_default_k;
+  uint64_t bf_default_size = config::bf_default_size;
+  bool use_bf = config::use_bf;
+  bool use_cache = config::use_cache;
+  size_t max_immutable_num = config::max_immutable_num;
+  size_t compaction_threads = config::compaction_threads;
+  size_t l0_stop_num = config::l0_stop_num;
+  size_t max_subcompactions = config::max_subcompactions;
+  size_t subcompaction_min_entries = config::subcompaction_min_entries;
+  bool lazy_load = config::lazy_load;
+  size_t fence_interval = config::fence_interval;
+  bool mmap_sst = config::mmap_sst;
+  size_t eytzinger_min_keys = config::eytzinger_min_keys;
+  size_t block_cache_size = config::block_cache_size;
+  size_t value_cache_size = config::value_cache_size;
+  size_t inline_value_size = config::inline_value_size;
+  size_t vlog_segment_size = config::vlog_segment_size;
+  double gc_dead_ratio = config::gc_dead_ratio;
+  size_t gc_region_size = config::gc_region_size;
+  size_t gc_interval_ms = config::gc_interval_ms;
+  SyncMode sync_mode = config::sync_mode;
+  size_t sync_interval_ms = config::sync_interval_ms;
+  size_t sync_bytes = config::sync_bytes;
+
+public:
+  Snapshot() = default;
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+  ~Snapshot();
+};
 using ConfigParam = struct ConfigParam {
   int bf_default_size;
   int bf_default_k;
@@ -0,0 +1,152 @@
+#ifndef __KEYINDEX_H
+#define __KEYINDEX_H
+
+#include "config.h"
+#include "type.h"
+#include <algorithm>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+/**
+ * @brief the keys of an in-memory SSTable in one contiguous array, so a search
+ * probe reads 8 bytes instead of a 24-byte kEntry (mostly padding). The
+ * kEntrys stay where they are, the index of a key is the index of its kEntry
+ * NOTE: two layouts
+ * sorted: the search narrows the range with a branchless binary search until
+ * at most scan_width keys are left, then compares them all with SIMD (AVX2 if
+ * the build enables it, else SSE2, else scalar)
+ * Eytzinger (config::eytzinger_min_keys keys or more): keys[k] is a node of
+ * an implicit binary search tree with the children 2k and 2k + 1 (keys[0]
+ * unused), so the first levels of every search share a few hot cache lines
+ * and the nodes 4 levels down are contiguous, the search prefetches them.
+ * ranks[k] maps a node back to the index of its kEntry
+ */
+class KeyIndex {
+  private:
+    std::vector<TKey> keys;
+    std::vector<u32> ranks; // NOTE: empty in the sorted layout
+    // NOTE: 16 nodes (two cache lines) are 4 levels below a node
+    static constexpr u64 prefetch_levels = 4;
+
+    /**
+    @brief fill the subtree of node k with the kEntrys from i in order
+     * @return u64 the index of the first kEntry not placed
+     */
+    u64 fill(const kEntrys &kes, u64 i, u64 k) {
+        if (k >= keys.size()) {
+            return i;
+        }
+        i = fill(kes, i, 2 * k);
+        keys[k] = kes[i].key;
+        ranks[k] = static_cast<u32>(i);
+        return fill(kes, i + 1, 2 * k + 1);
+    }
+    [[nodiscard]] u64 findEytzinger(TKey key) const {
+        const TKey *nodes = keys.data();
+        u64 n = keys.size();
+        u64 k = 1;
+        while (k < n) {
+            // HINT: may point past the end, a prefetch never faults
+            __builtin_prefetch(nodes + (k << prefetch_levels));
+            k = 2 * k + (nodes[k] < key);
+        }
+        // NOTE: the right turns since the last left one lead past the lower
+        // bound, drop them (and that left turn). k is 0 if every key < key
+        k >>= __builtin_ffsll(static_cast<long long>(~k));
+        return k != 0 && nodes[k] == key ? ranks[k] : npos;
+    }
+
+  public:
+    // NOTE: two cache lines of keys
+    static constexpr u64 scan_width = 16;
+    static constexpr u64 npos = -1;
+
+    KeyIndex() = default;
+    /**
+    @brief index the keys of kes, sorted ascending and unique
+     * @param  eytzinger_min the Eytzinger layout from this many keys on
+     */
+    explicit KeyIndex(const kEntrys &kes,
+                      u64 eytzinger_min = config::eytzinger_min_keys) {
+        if (!kes.empty() && kes.size() >= eytzinger_min) {
+            keys.resize(kes.size() + 1);
+            ranks.resize(kes.size() + 1);
+            fill(kes, 0, 1);
+            return;
+        }
+        keys.reserve(kes.size());
+        for (const auto &ke : kes) {
+            keys.push_back(ke.key);
+        }
+    }
+    [[nodiscard]] u64 size() const {
+        return ranks.empty() ? keys.size() : keys.size() - 1;
+    }
+    [[nodiscard]] bool isEytzinger() const { return !ranks.empty(); }
+    /**
+    @brief find the key
+     * @return u64 the index of its kEntry, npos if not found
+     */
+    [[nodiscard]] u64 find(TKey key) const {
+        if (isEytzinger()) {
+            return findEytzinger(key);
+        }
+        u64 n = keys.size();
+        if (n == 0) {
+            return npos;
+        }
+        const TKey *base = keys.data();
+        // HINT: the lower bound stays in [base, base + n], the ternary becomes
+        // a cmov so a mispredicted probe costs nothing
+        while (n > scan_width) {
+            u64 half = n / 2;
+            base = base[half] < key ? base + half : base;
+            n -= half;
+        }
+        // NOTE: the lower bound may be base + n itself
+        u64 first = base - keys.data();
+        n = std::min<u64>(n + 1, keys.size() - first);
+        u64 idx = scanEqual(base, n, key);
+        return idx == npos ? npos : first + idx;
+    }
+    /**
+    @brief linear scan of n keys for an equal one
+     * @return u64 its index in [0, n), npos if not found
+     */
+    static u64 scanEqual(const TKey *keys, u64 n, TKey key) {
+        u64 i = 0;
+#if defined(__AVX2__)
+        __m256i target = _mm256_set1_epi64x(static_cast<long long>(key));
+        for (; i + 4 <= n; i += 4) {
+            __m256i cur = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(keys + i));
+            int mask = _mm256_movemask_pd(
+                _mm256_castsi256_pd(_mm256_cmpeq_epi64(cur, target)));
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+#elif defined(__SSE2__)
+        __m128i target = _mm_set1_epi64x(static_cast<long long>(key));
+        for (; i + 2 <= n; i += 2) {
+            __m128i cur =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+            // HINT: SSE2 has no 64-bit compare, both 32-bit halves must match
+            __m128i eq = _mm_cmpeq_epi32(cur, target);
+            eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, 0xb1));
+            int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            if (keys[i] == key) {
+                return i;
+            }
+        }
+        return npos;
+    }
+};
+#endif
@@ -6,38 +6,63 @@
 #include "type.h"
 #include "utils.h"
 #include "vlog.h"
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <fstream>
 #include <filesystem>
+#include <iterator>
+#include <mutex>
 #include <set>
 #include <string>
 #define KB (1024)
 const std::string KVStore::delete_symbol = "~DELETED~";
 const size_t KVStore::max_sz = 16 * KB; // 16KB
 KVStore::KVStore(const std::string &dir, const std::string &vlog)
-    : KVStoreAPI(dir, vlog), pkvs(std::make_unique<skiplist::skiplist_type>()),
+    : KVStoreAPI(dir, vlog),
+      pkvs(std::make_shared<skiplist::skiplist_type>()),
       save_dir(dir),
       timestamp_path((std::filesystem::path(save_dir) / ".timestamp").string()),
+      flushed_path((std::filesystem::path(save_dir) / ".flushed").string()),
       vStore([dir, vlog]() {
           if (!utils::dirExists(dir)) {
               utils::mkdir(dir);
           }
           return vlog;
-      }()) {
+      }()),
+      coldStore((std::filesystem::path(save_dir) / "cold.vlog").string()),
+      current(std::make_shared<Version>()),
+      stop_flush(false),
+      stop_compact(false),
+      stop_gc(false) {
+    if (config::inline_value_size > sizeof(TOff)) [[unlikely]] {
+        // HINT: an inlined value lives in the offset field of its kEntry
+        std::string msg = "inline_value_size " +
+                          std::to_string(config::inline_value_size) +
+                          " is larger than " + std::to_string(sizeof(TOff));
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
     const std::string l0_dir = std::filesystem::path(save_dir) / "level_0";
     if (!config::use_cache) {
         // HINT: no cache banned ss_layer
         utils::mkdir(l0_dir);
-        return;
-    }
-    if (!utils::dirExists(l0_dir)) {
+        replayLog();
+    } else if (!utils::dirExists(l0_dir)) {
         utils::mkdir(l0_dir);
-        Layer l0;
+        replayLog();
     } else {
         loadTimeStamp(timestamp_path);
         rebuildMem();
     };
+    flush_thread = std::thread(&KVStore::flushLoop, this);
+    for (size_t i = 0; i < std::max<size_t>(config::compaction_threads, 1);
+         ++i) {
+        compact_threads.emplace_back(&KVStore::compactionLoop, this);
+    }
+    if (config::gc_dead_ratio > 0) {
+        gc_thread = std::thread(&KVStore::gcLoop, this);
+    }
 }
 void KVStore::loadTimeStamp(const std::string &path) {
     if (!std::filesystem::exists(path)) {
@@ -52,8 +77,98 @@ void KVStore::loadTimeStamp(const std::string &path) {
     if (!s.empty())
         SSTable::sstable_type::setCurID(std::stoull(s));
 }
+/**
+@brief read the flushed watermark of the vlog
+ * @param  last_id set to the SSTable timestamp the last finished flush
+ * reached, -1 if unknown (a file written before it was recorded)
+ * @return TOff 0 if the file is empty
+ */
+TOff KVStore::loadFlushed(const std::string &path, u64 *last_id) {
+    std::fstream ifs(path, std::ios::in);
+    std::string s;
+    std::string id;
+    ifs >> s >> id;
+    ifs.close();
+    if (last_id != nullptr) {
+        *last_id = id.empty() ? -1 : std::stoull(id);
+    }
+    return s.empty() ? 0 : std::stoull(s);
+}
+/**
+@brief save the flushed watermark, with the current SSTable timestamp: a
+level 0 file newer than it belongs to a flush that did not finish
+ */
+void KVStore::saveFlushed(TOff offset) {
+    std::fstream ofs(flushed_path, std::ios::out | std::ios::trunc);
+    std::string s = std::to_string(offset) + " " +
+                    std::to_string(SSTable::sstable_type::getCurID());
+    ofs.write(s.c_str(), s.size());
+    ofs.close();
+    if (config::sync_mode != config::SyncMode::none) {
+        utils::syncFile(flushed_path);
+    }
+}
+/**
+@brief replay the pairs logged after the flushed watermark into the memtable,
+they were lost with the memtables when the store went down
+ */
+void KVStore::replayLog() {
+    std::unique_lock lock(state_mtx);
+    if (!std::filesystem::exists(flushed_path)) {
+        // HINT: a new store, or one written before the vlog was the log
+        // (then everything in it is flushed)
+        saveFlushed(vStore.getHead());
+        return;
+    }
+    TOff offset = loadFlushed(flushed_path);
+    constexpr u64 chunk_size = 1024 * KB;
+    while (offset < vStore.getHead()) {
+        vEntrys ves;
+        std::vector<TOff> locs;
+        if (vStore.readVlogs(offset, ves, chunk_size, locs) == 0) {
+            break;
+        }
+        // NOTE: locs[i] is where ves[i] starts, locs.back() where the read
+        // stopped
+        auto loc = locs.begin();
+        for (const auto &ve : ves) {
+            if (cal_new_size() > max_sz) {
+                freeze_locked(*loc);
+            }
+            markReplaced(ve.key,
+                         pkvs->put(ve.key,
+                                   ve.vlen == 0 ? delete_symbol : ve.vvalue,
+                                   *loc));
+            ++loc;
+        }
+        offset = locs.back();
+    }
+}
 KVStore::~KVStore() {
-    compaction();
+    {
+        std::lock_guard lock(gc_wait_mtx);
+        stop_gc = true;
+    }
+    gc_cv.notify_all();
+    if (gc_thread.joinable()) {
+        gc_thread.join();
+    }
+    flushAll();
+    waitCompaction();
+    {
+        std::unique_lock lock(state_mtx);
+        stop_flush = true;
+    }
+    flush_cv.notify_all();
+    flush_thread.join();
+    {
+        std::lock_guard lock(compact_mtx);
+        stop_compact = true;
+    }
+    compact_cv.notify_all();
+    for (auto &t : compact_threads) {
+        t.join();
+    }
 
     std::fstream ofs(timestamp_path, std::ios::out);
     std::string s = std::to_string(SSTable::sstable_type::getCurID());
@@ -70,6 +185,9 @@ inline size_t KVStore::cal_new_size(size_t kv_num) {
 std::vector<std::string> getSortedSSTfileNames(const std::string &dir) {
     std::vector<std::string> ssts;
     utils::scanDir(dir, ssts);
+    // HINT: skip the .tmp files a running compaction is writing
+    std::erase_if(ssts,
+                  [](const std::string &s) { return !s.ends_with(".sst"); });
     // ATTENTION: ssts is filenames! NOT paths!
     // NOTE FIX: restore the order by timeStamp
     std::sort(ssts.begin(), ssts.end(),
@@ -80,14 +198,61 @@ std::vector<std::string> getSortedSSTfileNames(const std::string &dir) {
               });
     return ssts;
 }
+/**
+@brief remove the .tmp files of a compaction cut short by a crash, its inputs
+are all still in place then
+ */
+static void removeTmpFiles(const std::string &dir) {
+    std::vector<std::string> files;
+    utils::scanDir(dir, files);
+    for (const auto &file : files) {
+        if (file.ends_with(".tmp")) {
+            std::cerr << "drop unfinished sstable " << file << std::endl;
+            utils::rmfile(std::filesystem::path(dir) / file);
+        }
+    }
+}
+/**
+@brief order SSTables of level >= 1, newest in the begin
+ */
+static bool newer_first(const std::shared_ptr<SSTable::sstable_type> &s1,
+                        const std::shared_ptr<SSTable::sstable_type> &s2) {
+    return s1->getUID() > s2->getUID() ||
+           (s1->getUID() == s2->getUID() &&
+            s1->getHeader().getMinKey() > s2->getHeader().getMinKey());
+}
 
-void KVStore::forEachSST(std::function<bool(SSTable::sstable_type &)> func) {
+/**
+@brief pin the current version of the levels
+ */
+KVStore::VersionPtr KVStore::currentVersion() const {
+    std::lock_guard lock(version_mtx);
+    return current;
+}
+/**
+@brief publish the next version of the levels, layers_mtx should be held
+exclusively
+ */
+void KVStore::installVersion(Layers layers) {
+    auto next = std::make_shared<Version>();
+    next->layers = std::move(layers);
+    std::lock_guard lock(version_mtx);
+    current = std::move(next);
+}
+/**
+@brief visit the SSTables from the newest to the oldest until func returns
+true. In no-cache mode the level directories are read, layers_mtx should be
+held
+ * @param  version the pinned version (cache mode)
+ */
+void KVStore::forEachSST(const Version &version,
+                         std::function<bool(SSTable::sstable_type &)> func) {
 
     if (config::use_cache) {
-        for (auto &layer : this->ss_layers) {
+        for (const auto &layer : version.layers) {
             auto layer_size = layer.size();
             for (int i = layer_size - 1; i >= 0; --i) {
-                if (func(layer[i])) {
+                if (func(*layer[i])) {
                     return;
                 }
             }
@@ -116,24 +281,196 @@ void KVStore::forEachSST(std::function<bool(SSTable::sstable_type &)> func) {
  * No return values for simplicity.
  */
 void KVStore::put(uint64_t key, const std::string &s) {
+    {
+        // NOTE: many writers can insert into the memtable at once, only the
+        // one that finds it full takes the exclusive lock to flush it
+        // HINT: concurrent writers may overshoot max_sz by a few entries
+        std::shared_lock lock(state_mtx);
+        if (cal_new_size() <= max_sz) [[likely]] {
+            markReplaced(key, this->pkvs->put(key, s, logPut(key, s)));
+            return;
+        }
+    }
+    std::unique_lock lock(state_mtx);
+    put_locked(lock, key, s);
+}
+/**
+@brief put with state_mtx held exclusively, freeze the memtable if it is full
+ * @param  lock the held lock of state_mtx
+ * @param  wait false to skip the stall when the immutable queue is full
+ */
+void KVStore::put_locked(std::unique_lock<std::shared_mutex> &lock,
+                         uint64_t key, const std::string &s, bool wait) {
     // NOTE: check and update the sst_sz here
-    size_t new_sz = cal_new_size();
-    if (new_sz > max_sz) {
-        compaction();
+    while (cal_new_size() > max_sz) {
+        // HINT: writers only stall when too many memtables are queued
+        if (wait && imms.size() >= config::max_immutable_num) {
+            room_cv.wait(lock);
+            continue;
+        }
+        freeze_locked(vStore.getHead());
+    }
+    markReplaced(key, this->pkvs->put(key, s, logPut(key, s)));
+}
+/**
+@brief put the pairs gc moves, they are appended to coldStore with one
+addVlogs per memtable they land in. Never waits for room in imms, state_mtx
+should be held exclusively
+ */
+void KVStore::put_cold_locked(
+    const std::vector<std::pair<TKey, TValue>> &kvs) {
+    std::vector<vEntryProps> batch;
+    for (size_t done = 0; done < kvs.size(); done += batch.size()) {
+        if (cal_new_size() > max_sz) {
+            freeze_locked(vStore.getHead());
+        }
+        // NOTE: as many pairs as the memtable can take
+        size_t n = 1;
+        while (done + n < kvs.size() &&
+               cal_new_size(pkvs->size() + n + 1) <= max_sz) {
+            ++n;
+        }
+        batch.clear();
+        for (size_t i = done; i < done + n; ++i) {
+            const auto &[key, value] = kvs[i];
+            batch.push_back({.key = key,
+                             .vlen = static_cast<TLen>(value.size()),
+                             .vvalue = value});
+        }
+        auto offsets = coldStore.addVlogs(batch);
+        // HINT: a replaced value is the very entry gc is moving, it goes away
+        // with the chunk and is not counted
+        for (size_t i = 0; i < n; ++i) {
+            pkvs->put(kvs[done + i].first, kvs[done + i].second,
+                      offsets[i] | vlog_cold_flag);
+        }
+    }
+}
+/**
+@brief log the pair in the vlog (the write-ahead log), state_mtx should be
+held so the pair lands in the memtable it is logged for
+ * @return TOff the offset of the logged entry
+ */
+TOff KVStore::logPut(uint64_t key, const std::string &s) {
+    if (s == delete_symbol) {
+        // HINT: a tombstone, the entry keeps only the key
+        return vStore.addVlog({.key = key, .vlen = 0, .vvalue = ""});
+    }
+    return vStore.addVlog(
+        {.key = key, .vlen = static_cast<TLen>(s.size()), .vvalue = s});
+}
+/**
+@brief turn the memtable into an immutable one and hand it to the flush
+thread, state_mtx should be held exclusively
+ * @param  end the vlog offset after the last pair of the memtable
+ */
+void KVStore::freeze_locked(TOff end) {
+    if (pkvs->size() == 0) {
+        return;
+    }
+    imms.push_back(pkvs);
+    imm_ends.push_back(end);
+    pkvs = std::make_shared<skiplist::skiplist_type>();
+    flush_cv.notify_one();
+}
+/**
+@brief freeze the memtable and wait until all immutable memtables are flushed
+ */
+void KVStore::flushAll() {
+    std::unique_lock lock(state_mtx);
+    freeze_locked(vStore.getHead());
+    room_cv.wait(lock, [this]() { return imms.empty(); });
+}
+/**
+@brief the flush thread: write the oldest immutable memtable to vlog and
+level 0, then drop it from imms. Merging the levels is left to the compaction
+workers
+ */
+void KVStore::flushLoop() {
+    while (true) {
+        MemTable imm;
+        TOff imm_end;
+        {
+            std::unique_lock lock(state_mtx);
+            flush_cv.wait(lock,
+                          [this]() { return stop_flush || !imms.empty(); });
+            if (imms.empty()) {
+                return;
+            }
+            imm = imms.front();
+            imm_end = imm_ends.front();
+        }
+        {
+            // HINT: stall while level 0 piles up faster than it is compacted
+            std::unique_lock lock(compact_mtx);
+            compact_cv.wait(lock, [this]() {
+                std::shared_lock layers_lock(layers_mtx);
+                return levelSize(0) < config::l0_stop_num;
+            });
+        }
+        {
+            std::unique_lock lock(layers_mtx);
+            if (imm->size() != 0) {
+                save(*imm);
+            }
+            // NOTE: the pairs logged before imm_end are all in level 0 now
+            saveFlushed(imm_end);
+            vStore.checkpoint();
+            coldStore.checkpoint();
+        }
+        scheduleCompaction();
+        {
+            // NOTE: drop it only after the SSTable is visible, so a reader
+            // always finds the data in either place
+            std::unique_lock lock(state_mtx);
+            imms.pop_front();
+            imm_ends.pop_front();
+            ++dropped_imms;
+        }
+        room_cv.notify_all();
+    }
+}
+/**
+@brief search the memtable and the immutable memtables (newest first),
+state_mtx should be held
+ * @param  offset set to the vlog offset of the pair if found
+ * @return std::string "" if not found, delete_symbol if deleted
+ */
+std::string KVStore::mem_get(uint64_t key, TOff *offset) const {
+    TOff off = 0;
+    auto value = pkvs->get(key, off);
+    for (auto it = imms.rbegin(); value == "" && it != imms.rend(); ++it) {
+        value = (*it)->get(key, off);
+    }
+    if (offset != nullptr) {
+        *offset = off;
     }
-    this->pkvs->put(key, s);
+    return value;
 }
 /**
  * Returns the (string) value of the given key.
  * An empty string indicates not found.
  */
 std::string KVStore::get(uint64_t key) {
-    auto value = pkvs->get(key);
-    bool mem_exist = value != "";
+    {
+        std::shared_lock lock(state_mtx);
+        auto value = mem_get(key);
+        bool mem_exist = value != "";
 
-    if (mem_exist) {
-        return value == delete_symbol ? "" : value;
+        if (mem_exist) {
+            return value == delete_symbol ? "" : value;
+        }
+    }
+    // HINT: an immutable memtable dropped meanwhile is already in level 0
+    // NOTE: pin the version with vlog_mtx held, gc can not punch the values
+    // it points to until the lookup is done
+    std::shared_lock vlog_lock(vlog_mtx);
+    std::shared_lock layers_lock(layers_mtx, std::defer_lock);
+    if (!config::use_cache) {
+        // HINT: no-cache mode reads the level directories
+        layers_lock.lock();
     }
+    auto version = currentVersion();
     TValue v = "";
     // query in layers
     bool found = false;
@@ -147,13 +484,13 @@ std::string KVStore::get(uint64_t key) {
             found = true;
             return true;
         }
-        if ((v = vStore.query(ke)) != "") {
+        if ((v = vquery(ke)) != "") {
             found = true;
             return true;
         }
         return false;
     };
-    forEachSST(sst_query);
+    forEachSST(*version, sst_query);
     return v;
 }
 /**
@@ -173,19 +510,31 @@ bool KVStore::del(uint64_t key) {
  * including memtable and all sstables files.
  */
 void KVStore::reset() {
+    std::lock_guard gc_lock(gc_mtx);
+    // HINT: let the flush thread and the compaction workers go idle before the
+    // files are removed
+    flushAll();
+    waitCompaction();
+    std::unique_lock lock(state_mtx);
+    std::unique_lock vlog_lock(vlog_mtx);
+    std::unique_lock layers_lock(layers_mtx);
     // clear file
     if (std::filesystem::exists(save_dir)) {
         std::filesystem::remove_all(save_dir);
         utils::mkdir(save_dir);
     }
     // clear mem
-    pkvs = std::make_unique<skiplist::skiplist_type>();
+    pkvs = std::make_shared<skiplist::skiplist_type>();
     vStore.clear();
-    // clear cache
-    if (config::use_cache)
-        ss_layers = std::vector<Layer>();
+    coldStore.clear();
     // reset global state
     SSTable::sstable_type::resetID();
+    saveFlushed(0);
+    // clear cache
+    // HINT: the new files may reuse the inodes (and timestamps) of the removed
+    // ones within one mtime tick, see BlockKey
+    SSTable::sstable_type::blockCache().clear();
+    installVersion(Layers());
 }
 
 /**
@@ -195,8 +544,35 @@ void KVStore::reset() {
  */
 void KVStore::scan(uint64_t key1, uint64_t key2,
                    std::list<std::pair<uint64_t, std::string>> &list) {
-    kEntrys kvec;
-    const auto mem_list = pkvs->scan(key1, key2);
+    std::list<skiplist::kvpair> mem_list;
+    {
+        // NOTE: merge the memtable and the immutable memtables, the newer one
+        // wins on the same key
+        std::shared_lock lock(state_mtx);
+        mem_list = pkvs->scan(key1, key2);
+        for (auto imm = imms.rbegin(); imm != imms.rend(); ++imm) {
+            auto older = (*imm)->scan(key1, key2);
+            std::list<skiplist::kvpair> merged;
+            std::merge(mem_list.begin(), mem_list.end(), older.begin(),
+                       older.end(), std::back_inserter(merged),
+                       [](const skiplist::kvpair &a,
+                          const skiplist::kvpair &b) {
+                           return a.first < b.first;
+                       });
+            // HINT: std::merge is stable, the newer pair comes first
+            merged.unique([](const skiplist::kvpair &a,
+                             const skiplist::kvpair &b) {
+                return a.first == b.first;
+            });
+            mem_list = std::move(merged);
+        }
+    }
+    std::shared_lock vlog_lock(vlog_mtx);
+    std::shared_lock layers_lock(layers_mtx, std::defer_lock);
+    if (!config::use_cache) {
+        layers_lock.lock();
+    }
+    auto version = currentVersion();
     std::vector<kEntrys> layer_kvs;
     auto sst_scan = [&ans = layer_kvs, key1 = key1,
                      key2 = key2](SSTable::sstable_type &sst) {
@@ -207,7 +583,7 @@ void KVStore::scan(uint64_t key1, uint64_t key2,
         }
         return false;
     };
-    forEachSST(sst_scan);
+    forEachSST(*version, sst_scan);
     kEntrys merge_layers;
     utils::mergeKSorted(layer_kvs, merge_layers);
 
@@ -222,7 +598,7 @@ void KVStore::scan(uint64_t key1, uint64_t key2,
             it++;
         } else if (it2->key < it->first) {
             if (it2->len != 0) {
-                list.emplace_back(it2->key, vStore.query(*it2));
+                list.emplace_back(it2->key, vquery(*it2));
             }
             it2++;
         } else {
@@ -240,7 +616,7 @@ void KVStore::scan(uint64_t key1, uint64_t key2,
     }
     for (; it2 != merge_layers.end(); it2++) {
         if (it2->len != 0) {
-            list.emplace_back(it2->key, vStore.query(*it2));
+            list.emplace_back(it2->key, vquery(*it2));
         }
     }
 }
@@ -251,140 +627,385 @@ void KVStore::scan(uint64_t key1, uint64_t key2,
  * recycle.
  */
 void KVStore::gc(uint64_t chunk_size) {
-    // TODO what if interrupt in gc?
+    std::lock_guard gc_lock(gc_mtx);
+    gc_locked(vStore, chunk_size);
+}
+/**
+@brief the background gc: collect the densest tail chunk of the vlog when
+its dead ratio reaches config::gc_dead_ratio
+ */
+void KVStore::gcLoop() {
+    // HINT: only the first few regions behind the tail are worth a look
+    constexpr size_t max_regions = 8;
+    std::unique_lock lock(gc_wait_mtx);
+    while (!stop_gc) {
+        gc_cv.wait_for(lock, std::chrono::milliseconds(config::gc_interval_ms));
+        if (stop_gc) {
+            continue;
+        }
+        u64 chunk = vStore.gcChunk(config::gc_dead_ratio, max_regions);
+        u64 cold_chunk = coldStore.gcChunk(config::gc_dead_ratio, max_regions);
+        if (chunk == 0 && cold_chunk == 0) {
+            continue;
+        }
+        lock.unlock();
+        try {
+            if (chunk != 0) {
+                gc(chunk);
+            } else {
+                std::lock_guard gc_lock(gc_mtx);
+                gc_locked(coldStore, cold_chunk);
+            }
+        } catch (const std::runtime_error &e) {
+            // HINT: a corrupted SSTable fails the lookup before anything is
+            // moved, the chunk stays and the error is left to the readers
+            std::cerr << "background gc failed: " << e.what() << std::endl;
+        }
+        lock.lock();
+    }
+}
+/**
+@brief gc with gc_mtx held
+ * @param  store vStore or coldStore, the live values go to coldStore
+ */
+void KVStore::gc_locked(vLogs &store, uint64_t chunk_size) {
     // HINT: the size of the value to be recycled is strictly no less than
     // chunk_size
-    // NOTE: first, search the vlog tail
-    vStore.relocTail();
-    std::cout << "tail is " << vStore.getTail() << " now" << std::endl;
+    // NOTE: first, read the vlog tail. Only gc moves the tail and the appends
+    // go to the head, so the read needs no lock
+    store.relocTail();
+    Log("tail is %lu now", store.getTail());
     vEntrys ves;
     std::vector<TOff> locs;
-    auto tail = vStore.getTail();
-    size_t read_size = vStore.readVlogs(tail, ves, chunk_size, locs);
+    auto tail = store.getTail();
+    size_t read_size = store.readVlogs(tail, ves, chunk_size, locs);
+    const TOff flag = &store == &coldStore ? vlog_cold_flag : 0;
     if (read_size == 0) {
         // vLog has no items now
         return;
     }
-    // NOTE: second, find in lsmtree(search in SSTables)
-
-    // HINT: ve -> key -> find the ke with the key in the sstables
-    // -> new(loc of ve == ke.offset) ? insert to memtable : do nothing
-    int idx = 0;
-    bool found = false;
-    auto find = [](SSTable::sstable_type &sst, TKey key, bool &found,
-                   kEntry &ke) {
-        ke = sst.query(key); // HINT: header and BF: may exist?
-        if (ke != type::ke_not_found) {
-            // NOTE: because find order is from newest to
-            // oldest, so if found and the offsets not equal,
-            // breaks also.
-            found = true;
-            return true;
+    // NOTE: second, find the newest kEntry of every key of the chunk, the
+    // keys are sorted and deduplicated and resolved in one merged pass over
+    // every SSTable. Writers and readers go on meanwhile
+    std::vector<TKey> keys;
+    keys.reserve(ves.size());
+    for (const auto &ve : ves) {
+        keys.push_back(ve.key);
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    std::vector<kEntry> kes;
+    std::vector<char> found;
+    u64 seen = gcLookup(keys, kes, found, false);
+    // NOTE: the writers pause from here until the live values are put back,
+    // so a newer write can not be overwritten by an old value
+    std::unique_lock lock(state_mtx);
+    constexpr int max_retries = 3;
+    for (int retry = 0; dropped_imms != seen; ++retry) {
+        // HINT: a memtable was dropped since the lookup, a newer write it held
+        // is only in the SSTables now. Look again, at last with the lock held
+        if (retry < max_retries) {
+            lock.unlock();
+            seen = gcLookup(keys, kes, found, false);
+            lock.lock();
+        } else {
+            seen = gcLookup(keys, kes, found, true);
         }
-        return false;
-    };
+    }
+    // HINT: ve -> key -> the newest ke with the key
+    // -> new(loc of ve == ke.offset) and not deleted ? move it : do nothing
+    // NOTE: the memtables have every write since the lookup, one of them
+    // shadows what the lookup found
+    std::vector<std::pair<TKey, TValue>> lives;
+    int idx = 0;
     for (const auto &ve : ves) {
-
-        kEntry ke = type::ke_not_found;
-        found = false;
-        // try to found in mem
-        if (pkvs->get(ve.key) != "") {
-            idx++;
+        auto i = std::lower_bound(keys.begin(), keys.end(), ve.key) -
+                 keys.begin();
+        const TOff loc = locs.at(idx) | flag;
+        ++idx;
+        if (!found[i] || kes[i].is_inline() || kes[i].offset != loc ||
+            ve.vlen == 0) {
             continue;
         }
-        // try to found in sstables
-        if (!found) {
-            auto ve_find = [ve, find, &found, &ke](SSTable::sstable_type &sst) {
-                return find(sst, ve.key, found, ke);
-            };
-
-            forEachSST(ve_find);
+        TOff mem_offset;
+        if (mem_get(ve.key, &mem_offset) != "" && mem_offset != loc) {
+            continue;
         }
-
-        if (!found) {
-            ++idx;
+        lives.emplace_back(ve.key, ve.vvalue);
+    }
+    put_cold_locked(lives);
+    lock.unlock();
+    // NOTE: third, flush the moved values and reclaim the chunk. A crash
+    // before the tail moves keeps the chunk, the moved copies are only
+    // duplicates of its live values then
+    flushAll();
+    // HINT: the live values are in level 0 now, wait for the readers still
+    // following the old offsets
+    std::unique_lock vlog_lock(vlog_mtx);
+    std::unique_lock layers_lock(layers_mtx);
+    store.gc(tail + read_size);
+}
+/**
+@brief find the newest kEntry of each key in the memtables and the SSTables
+(newest first), for gc
+ * @param  keys sorted ascending
+ * @param  kes kes[i] is set to the kEntry of keys[i] if found, a memtable
+ * pair gets its offset only
+ * @param  found found[i] marks keys[i] found
+ * @param  state_locked true if state_mtx is held exclusively
+ * @return u64 dropped_imms when the memtables were searched
+ */
+u64 KVStore::gcLookup(const std::vector<TKey> &keys, std::vector<kEntry> &kes,
+                      std::vector<char> &found, bool state_locked) {
+    kes.assign(keys.size(), type::ke_not_found);
+    found.assign(keys.size(), 0);
+    size_t pending = keys.size();
+    u64 seen;
+    {
+        std::shared_lock lock(state_mtx, std::defer_lock);
+        if (!state_locked) {
+            lock.lock();
+        }
+        seen = dropped_imms;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            // NOTE: the memtable may still point to the entry (it is logged
+            // at put time), then it is live and moved like the others
+            TOff mem_offset;
+            if (mem_get(keys[i], &mem_offset) != "") {
+                kes[i] = {.key = keys[i], .offset = mem_offset, .len = 0};
+                found[i] = 1;
+                --pending;
+            }
+        }
+    }
+    if (pending == 0) {
+        return seen;
+    }
+    // HINT: the version pinned after the memtables were searched has every
+    // memtable dropped since, and a drop is caught by the caller
+    std::shared_lock layers_lock(layers_mtx, std::defer_lock);
+    if (!config::use_cache) {
+        // HINT: no-cache mode reads the level directories
+        layers_lock.lock();
+    }
+    auto batch_find = [&keys, &kes, &found,
+                       &pending](SSTable::sstable_type &sst) {
+        pending -= sst.queryBatch(keys, kes, found);
+        return pending == 0;
+    };
+    forEachSST(*currentVersion(), batch_find);
+    return seen;
+}
+/**
+@brief read the value from the stream ke.offset points into
+ */
+TValue KVStore::vquery(kEntry ke) {
+    if (ke.is_inline()) {
+        return ke.inline_value();
+    }
+    if ((ke.offset & vlog_cold_flag) != 0) {
+        ke.offset &= ~vlog_cold_flag;
+        return coldStore.query(ke);
+    }
+    return vStore.query(ke);
+}
+/**
+@brief count the vlog entry of ke as garbage in the stream it belongs to
+ */
+void KVStore::markDead(const kEntry &ke) {
+    if (ke.is_inline()) {
+        // HINT: not in any vlog
+        return;
+    }
+    if ((ke.offset & vlog_cold_flag) != 0) {
+        coldStore.markDead(ke.offset & ~vlog_cold_flag, ke.len);
+    } else {
+        vStore.markDead(ke.offset, ke.len);
+    }
+}
+/**
+@brief count the vlog entry a memtable put replaced as garbage, state_mtx
+should be held (the value bytes live in the memtable)
+ */
+void KVStore::markReplaced(uint64_t key, const skiplist::replaced &old) {
+    if (!old.found) {
+        return;
+    }
+    // HINT: a tombstone is logged without a value
+    TLen len =
+        old.value == delete_symbol ? 0 : static_cast<TLen>(old.value.size());
+    markDead({.key = key, .offset = old.offset, .len = len});
+}
+/**
+@brief the directory of the level
+ */
+std::filesystem::path KVStore::levelDir(int level) const {
+    return std::filesystem::path(save_dir) / ("level_" + std::to_string(level));
+}
+/**
+@brief whether the level exists, layers_mtx should be held
+ */
+bool KVStore::levelExists(int level) const {
+    if (config::use_cache) {
+        return level < static_cast<int>(currentVersion()->layers.size());
+    }
+    return utils::dirExists(levelDir(level));
+}
+/**
+@brief number of SSTables in the level, layers_mtx should be held
+ */
+size_t KVStore::levelSize(int level) const {
+    if (!levelExists(level)) {
+        return 0;
+    }
+    if (config::use_cache) {
+        return currentVersion()->layers.at(level).size();
+    }
+    return getSortedSSTfileNames(levelDir(level)).size();
+}
+/**
+@brief copy (or load in no-cache mode) the SSTables of the level, oldest
+first in level 0, layers_mtx should be held
+ */
+KVStore::Layer KVStore::loadLayer(int level) const {
+    Layer layer;
+    if (!levelExists(level)) {
+        return layer;
+    }
+    if (config::use_cache) {
+        return currentVersion()->layers.at(level);
+    }
+    auto cur_dir = levelDir(level);
+    for (auto &sst_file : getSortedSSTfileNames(cur_dir)) {
+        auto sst = std::make_shared<SSTable::sstable_type>();
+        sst->load(cur_dir / sst_file);
+        layer.push_back(std::move(sst));
+    }
+    return layer;
+}
+/**
+@brief find a level that overflows and whose job does not overlap a running
+one, compact_mtx should be held (layers_mtx should NOT be held)
+ * @return int the level to merge into the next one, -1 if none
+ */
+int KVStore::pickCompaction() const {
+    std::shared_lock lock(layers_mtx);
+    // HINT: lower levels first, level 0 blocks the flush thread
+    for (int level = 0; levelExists(level); ++level) {
+        if (compacting_levels.contains(level) ||
+            compacting_levels.contains(level + 1)) {
             continue;
         }
-
-        // NOTE: if in mem, do nothing
-        // NOTE: if ** found ** and ** new ** and ** is not delete **
-        // insert to memtable
-        // else do nothing
-        if (ke.offset == locs.at(idx) && ke.len != 0) {
-            this->put(ke.key, ve.vvalue);
+        if (levelSize(level) > static_cast<size_t>(level_limit(level))) {
+            return level;
         }
-
-        ++idx;
     }
-    // NOTE: third, compaction and de_alloc_file
-    compaction();
-    // utils::de_alloc_file(vStore.getPath(), tail, read_size);
-    vStore.gc(tail + read_size);
+    return -1;
+}
+/**
+@brief wake up the compaction workers after the levels changed
+ */
+void KVStore::scheduleCompaction() {
+    // NOTE: take the lock so a worker checking the levels can not miss it
+    { std::lock_guard lock(compact_mtx); }
+    compact_cv.notify_all();
+}
+/**
+@brief wait until no level overflows and no compaction job is running
+ */
+void KVStore::waitCompaction() {
+    std::unique_lock lock(compact_mtx);
+    compact_cv.wait(lock, [this]() {
+        return compacting_levels.empty() && pickCompaction() < 0;
+    });
 }
 /**
- * @brief
- * @param  layers
+@brief a compaction worker: pick a job, mark level n and n + 1 busy, merge
+them without blocking the others
+ */
+void KVStore::compactionLoop() {
+    std::unique_lock lock(compact_mtx);
+    while (true) {
+        int level = -1;
+        compact_cv.wait(lock, [this, &level]() {
+            return stop_compact || (level = pickCompaction()) >= 0;
+        });
+        if (level < 0) {
+            return;
+        }
+        compacting_levels.insert(level);
+        compacting_levels.insert(level + 1);
+        lock.unlock();
+        runCompaction(level);
+        lock.lock();
+        compacting_levels.erase(level);
+        compacting_levels.erase(level + 1);
+        // HINT: the next level may overflow now, and waiters check again
+        compact_cv.notify_all();
+    }
+}
+/**
+ * @brief merge the overflow of level from into level from + 1. all of level 0
+ * or the oldest overflow part of level n >= 1 is merged with the intersecting
+ * SSTables of the next level. The merge runs without layers_mtx, only the
+ * install of the result takes it exclusively.
+ * NOTE: the caller marks from and from + 1 busy, so no other job changes
+ * them meanwhile (the flush thread only appends to level 0)
  * @param  from
- * @param  src  src should be independent(the copy of layers[i] or overflow)
  */
-void KVStore::mergeLayers_Helper(int from, const Layer &src) {
-    // ATTENTION: DO NOT USE PUSH/DEL TO CHANGE THE LAYERS IN THE
-    // FUNCTION!(ALWAYS CONSIDER VECTOR REALLOC) NOTE: we choose to update the
-    // cache first and then the files, choose the intersection part of src and
-    // dst NOTE: the sst order in level >= 1 is guaranteed
+void KVStore::runCompaction(int from) {
+    // NOTE: the sst order in level >= 1 is guaranteed
     // TODO: optimize merge(and completely change the
     // get/scan/cache/... use binary search(for sst) in layer and break the "the
     // newest one in the last" rule)
-
-    Layer new_overflow;
-    int dst_level = from + 1;
-    auto dst_save_dir = std::filesystem::path(save_dir) /
-                        ("level_" + std::to_string(dst_level));
-    if (dst_level > this->ss_layers.size() - 1) {
-        if (config::use_cache) {
-            ss_layers.push_back(Layer());
-        }
-        if (!std::filesystem::exists(dst_save_dir)) {
-            utils::mkdir(dst_save_dir);
-        }
-    }
+    const int dst_level = from + 1;
+    const auto src_save_dir = levelDir(from);
+    const auto dst_save_dir = levelDir(dst_level);
+    Layer src;
     Layer dst;
-    if (config::use_cache) {
-        dst = ss_layers.at(dst_level);
-    } else {
-        auto cur_dir = std::filesystem::path(save_dir) /
-                       ("level_" + std::to_string(dst_level));
-        if (!utils::dirExists(cur_dir)) {
-            utils::mkdir(cur_dir);
+    {
+        std::shared_lock lock(layers_mtx);
+        Layer cur = loadLayer(from);
+        const size_t src_limit = level_limit(from);
+        if (cur.size() <= src_limit) {
+            return;
         }
-        std::vector<std::string> sst_files;
-        sst_files = getSortedSSTfileNames(cur_dir);
-        for (auto &sst_file : sst_files) {
-            SSTable::sstable_type sst;
-            sst.load(cur_dir / sst_file);
-            dst.push_back(sst);
+        if (from == 0) {
+            // HINT: merge all L0, oldest first
+            src = std::move(cur);
+        } else {
+            // HINT: newest in the begin, the older overflow part goes down
+            std::sort(cur.begin(), cur.end(), newer_first);
+            for (size_t i = cur.size(); i > src_limit; --i) {
+                src.push_back(cur.at(i - 1));
+            }
+        }
+        dst = loadLayer(dst_level);
+        // HINT: only this job writes the dst level, the empty directory is
+        // harmless to readers
+        if (!utils::dirExists(dst_save_dir)) {
+            utils::mkdir(dst_save_dir);
         }
     }
+    Log("compaction L%d -> L%d start:", from, dst_level);
 
-    const int limit = level_limit(dst_level);
-    u64 merge_max_id = 0;
-    for_each(src.begin(), src.end(),
-             [&merge_max_id](const SSTable::sstable_type &sst) {
-                 merge_max_id =
-                     merge_max_id > sst.getUID() ? merge_max_id : sst.getUID();
-             });
+    // NOTE: the new SSTables take a fresh timestamp, newer than every input,
+    // so their names never collide with a file they replace
+    const u64 merge_id = SSTable::sstable_type::incrTotalID();
 
-    std::vector<int> intersection_idxs;
-    std::vector<int> no_intersection_idxs;
-    std::set<std::string> no_save_files;
-    // HINT: file in no-intersection and won't be saved again(but may be removed
-    // because of overflow)
+    std::vector<size_t> intersection_idxs;
+    std::vector<size_t> no_intersection_idxs;
+    // HINT: the dst files that intersect src, they are merged and replaced
     std::vector<std::string> remove_files;
     auto dst_size = dst.size();
-    for (int i = 0; i < dst_size; ++i) {
+    for (size_t i = 0; i < dst_size; ++i) {
         bool section_flag = false;
-        const auto &d_sst = dst.at(i);
-        for (auto &s_sst : src) {
+        const auto &d_sst = *dst.at(i);
+        // ATTENTION: a lazy SSTable reads its kEntrys into a new vector, hold
+        // it for the whole loop (read once, only if some src overlaps)
+        std::shared_ptr<kEntrys> d_kes;
+        for (auto &s_sst_ptr : src) {
+            const auto &s_sst = *s_sst_ptr;
             TKey d_min = d_sst.getHeader().getMinKey();
             TKey d_max = d_sst.getHeader().getMaxKey();
             TKey s_min = s_sst.getHeader().getMinKey();
@@ -394,7 +1015,10 @@ void KVStore::mergeLayers_Helper(int from, const Layer &src) {
                 continue;
             }
             // NOTE: iterate all pairs
-            for (const auto &ke : *(d_sst.getKEntrys())) {
+            if (d_kes == nullptr) {
+                d_kes = d_sst.getKEntrys();
+            }
+            for (const auto &ke : *d_kes) {
                 if (!(s_sst.query(ke.key) == type::ke_not_found)) {
                     section_flag = true;
                     break;
@@ -406,19 +1030,15 @@ void KVStore::mergeLayers_Helper(int from, const Layer &src) {
                 remove_files.push_back(d_sst.gen_filename());
                 // HINT: all intersection part files shoule be deleted
                 intersection_idxs.push_back(i);
-
-                section_flag = true;
                 break;
             }
         }
         if (!section_flag) {
             no_intersection_idxs.push_back(i);
-            no_save_files.insert(d_sst.gen_filename());
         }
     }
     // second, merge the intersection part
     std::vector<kEntrys> intersection_kes;
-    kEntrys new_dst_kes;
     // HINT: priority: src from new to old, then dst from new to old to keep the
     // priority
     auto intersection_size = intersection_idxs.size();
@@ -426,41 +1046,91 @@ void KVStore::mergeLayers_Helper(int from, const Layer &src) {
     // change the order
     for (int i = src_size - 1; i >= 0; --i) {
         kEntrys kes;
-        const SSTable::sstable_type &sst = src.at(i);
+        const SSTable::sstable_type &sst = *src.at(i);
         sst.scan(sst.getHeader().getMinKey(), sst.getHeader().getMaxKey(), kes);
         intersection_kes.push_back(std::move(kes));
     }
     for (int i = intersection_size - 1; i >= 0; --i) {
         kEntrys kes;
-        const SSTable::sstable_type &sst = dst.at(intersection_idxs.at(i));
+        const SSTable::sstable_type &sst = *dst.at(intersection_idxs.at(i));
         sst.scan(sst.getHeader().getMinKey(), sst.getHeader().getMaxKey(), kes);
         intersection_kes.push_back(std::move(kes));
     }
 
-    utils::mergeKSorted(intersection_kes, new_dst_kes);
-    // generate new SSTables
-    Layer merged_ssts;
-    kEntrys tmp;
-    int ke_num = 0;
-    size_t no_intersection_size = no_intersection_idxs.size();
-    size_t new_dst_kes_size = new_dst_kes.size();
-    for (int i = 0; i < new_dst_kes_size; ++i) {
-        tmp.push_back(new_dst_kes[i]);
-        ++ke_num;
-        if (cal_new_size(ke_num + 1) > max_sz) {
-            ke_num = 0;
-            merged_ssts.emplace_back(tmp, merge_max_id);
-            tmp.clear();
-            tmp.resize(0);
+    // NOTE: a large merge is split by the min keys of the input SSTables into
+    // key-range shards (subcompactions), each one merged, cut into SSTables
+    // and written by its own thread
+    size_t total_kes = 0;
+    std::vector<TKey> min_keys;
+    for (const auto &kes : intersection_kes) {
+        total_kes += kes.size();
+        if (!kes.empty()) {
+            min_keys.push_back(kes.front().key);
+        }
+    }
+    std::sort(min_keys.begin(), min_keys.end());
+    min_keys.erase(std::unique(min_keys.begin(), min_keys.end()),
+                   min_keys.end());
+    // HINT: shard i is [bounds[i - 1], bounds[i]), the first and the last one
+    // are open
+    std::vector<TKey> bounds;
+    if (total_kes >= config::subcompaction_min_entries &&
+        min_keys.size() > 1) {
+        size_t shard_num = std::min(config::max_subcompactions, min_keys.size());
+        for (size_t i = 1; i < shard_num; ++i) {
+            bounds.push_back(min_keys[i * min_keys.size() / shard_num]);
+        }
+    }
+    std::vector<Layer> shard_ssts(bounds.size() + 1);
+    // NOTE: the overwritten kEntrys the merge drops, their vlog entries are
+    // garbage once the new level is installed
+    std::vector<kEntrys> shard_dropped(bounds.size() + 1);
+    auto run_shard = [&](size_t shard) {
+        auto key_less = [](const kEntry &ke, TKey key) { return ke.key < key; };
+        kEntrys merged_kes;
+        if (bounds.empty()) {
+            utils::mergeKSorted(intersection_kes, merged_kes,
+                                &shard_dropped[shard]);
+        } else {
+            std::vector<kEntrys> shard_kes;
+            for (const auto &kes : intersection_kes) {
+                auto first = shard == 0 ? kes.begin()
+                                        : std::lower_bound(kes.begin(),
+                                                           kes.end(),
+                                                           bounds[shard - 1],
+                                                           key_less);
+                auto last = shard == bounds.size()
+                                ? kes.end()
+                                : std::lower_bound(first, kes.end(),
+                                                   bounds[shard], key_less);
+                shard_kes.emplace_back(first, last);
+            }
+            utils::mergeKSorted(shard_kes, merged_kes, &shard_dropped[shard]);
+        }
+        build_ssts(merged_kes, merge_id, shard_ssts[shard]);
+        // NOTE: write the new files aside first, a torn one is never loaded
+        for (auto &sst : shard_ssts[shard]) {
+            auto tmp_path = dst_save_dir / (sst->gen_filename() + ".tmp");
+            sst->save(tmp_path);
+            if (SSTable::sstable_type::lazyMode()) {
+                // HINT: the open file survives the rename
+                sst->dropKEntrys(tmp_path);
+            }
         }
+    };
+    std::vector<std::thread> subcompactions;
+    for (size_t shard = 1; shard < shard_ssts.size(); ++shard) {
+        subcompactions.emplace_back(run_shard, shard);
     }
-    if (tmp.size() != 0) {
-        merged_ssts.emplace_back(tmp, merge_max_id);
-        tmp.clear();
-        tmp.resize(0);
+    run_shard(0);
+    for (auto &t : subcompactions) {
+        t.join();
+    }
+    Layer merged_ssts;
+    for (auto &ssts : shard_ssts) {
+        std::move(ssts.begin(), ssts.end(), std::back_inserter(merged_ssts));
     }
 
-    auto merged_ssts_size = merged_ssts.size();
     Layer final_dst;
     for (auto idx : no_intersection_idxs) {
         final_dst.push_back(dst.at(idx));
@@ -469,136 +1139,91 @@ void KVStore::mergeLayers_Helper(int from, const Layer &src) {
         final_dst.push_back(sst);
     }
     // HINT: newest in the begin
-    std::sort(
-        final_dst.begin(), final_dst.end(),
-        [](const SSTable::sstable_type &s1, const SSTable::sstable_type &s2) {
-            return s1.getUID() > s2.getUID() ||
-                   (s1.getUID() == s2.getUID() &&
-                    s1.getHeader().getMinKey() > s2.getHeader().getMinKey());
-        });
-    if (no_intersection_size + merged_ssts_size > limit) {
-        // HINT: no_intersection is older and should be merged first
-        size_t overflow_size = no_intersection_size + merged_ssts_size - limit;
-        for (int i = 0; i < overflow_size; ++i) {
-            auto &sst = final_dst.back();
-            new_overflow.push_back(sst);
-            remove_files.push_back(sst.gen_filename());
-            final_dst.pop_back();
-        }
+    std::sort(final_dst.begin(), final_dst.end(), newer_first);
+    // NOTE: install, readers see either the old levels or the new ones
+    std::unique_lock lock(layers_mtx);
+    std::set<std::string> src_files;
+    for (auto &sst : src) {
+        src_files.insert(sst->gen_filename());
     }
-    assert(final_dst.size() <= limit);
     if (config::use_cache) {
-        ss_layers.at(dst_level) = final_dst;
+        // NOTE: the next version shares the untouched SSTables
+        Layers layers = currentVersion()->layers;
+        while (layers.size() <= static_cast<size_t>(dst_level)) {
+            layers.push_back(Layer());
+        }
+        // HINT: level 0 may have got new SSTables meanwhile, keep them
+        std::erase_if(layers.at(from), [&src_files](const SSTPtr &sst) {
+            return src_files.contains(sst->gen_filename());
+        });
+        layers.at(dst_level) = std::move(final_dst);
+        installVersion(std::move(layers));
     }
-
-    // NOTE: sync to files
-    if (!utils::dirExists(dst_save_dir)) {
-        std::cerr << "dst_save_dir does not exist" << std::endl;
-        assert(0);
-        return;
+    // ATTENTION: every new file is in place before any input goes, a crash
+    // in between leaves both, the newer timestamp keeps the merged pairs
+    // ahead of the stale inputs of the same level
+    for (auto &sst : merged_ssts) {
+        auto sst_path = dst_save_dir / sst->gen_filename();
+        std::filesystem::rename(sst_path.string() + ".tmp", sst_path);
+    }
+    for (auto &filename : src_files) {
+        utils::rmfile(src_save_dir / filename);
     }
-    std::vector<std::string> filenames;
-    utils::scanDir(dst_save_dir, filenames);
-    // NOTE: remove files to sync with cache
     for (auto &filename : remove_files) {
-        auto sst_path = dst_save_dir / filename;
-        if (!std::filesystem::exists(sst_path)) {
-            continue;
-        }
-        utils::rmfile(sst_path);
+        utils::rmfile(dst_save_dir / filename);
     }
-    // NOTE: add new merged file
-    auto &to_save_ssts =
-        config::use_cache ? ss_layers.at(dst_level) : final_dst;
-    for (auto &sst : to_save_ssts) {
-        // already exists
-        if (no_save_files.find(sst.gen_filename()) != no_save_files.end()) {
-            continue;
+    for (const auto &dropped : shard_dropped) {
+        for (const auto &ke : dropped) {
+            markDead(ke);
         }
-        std::string sst_filename = sst.gen_filename();
-        auto sst_path = dst_save_dir / sst_filename;
-        sst.save(sst_path);
-    }
-
-    // NOTE: if the merged_ssts.size() + no_intersection.size() > limit,
-    // recursion
-
-    if (new_overflow.size() > 0) {
-        mergeLayers_Helper(dst_level, new_overflow);
     }
 }
-
 /**
- * @brief compaction in sstable layers
+@brief cut the sorted kEntrys into SSTables no larger than max_sz
+ * @param  kes
+ * @param  timeStamp the timestamp of the new SSTables
+ * @param  ssts the new SSTables are appended
  */
-void KVStore::compaction() {
-    // called when sst_sz > max_sz
-    if (pkvs->size() == 0) {
-        return;
-    }
-    Log("compaction start:");
-    auto l0_dir = std::filesystem::path(save_dir) / "level_0";
-    if (!utils::dirExists(l0_dir)) {
-        utils::mkdir(l0_dir);
-    }
-    std::vector<std::string> l0_ssts;
-    if (is_empty(l0_dir)) {
-        save();
-        utils::printDir(save_dir);
-        return;
-    }
-    utils::scanDir(l0_dir, l0_ssts);
-
-    if (l0_ssts.size() + 1 > level_limit(0)) {
-        // TODO, merge
-        Log("merge start:");
-        // HINT: merge all L0 and L1, update the cache
-        // if L1 is full, merge the overflow part(choose the earlier and key is
-        // less one) of L1 and L2, and so on not save file in l0
-        SSTable::sstable_type new_sstable;
-        convert_sst(new_sstable, vStore);
-        this->pkvs = std::make_unique<skiplist::skiplist_type>();
-        Layer level_0_vec;
-        if (config::use_cache) {
-            for (const auto &sst : ss_layers.at(0)) {
-                level_0_vec.push_back(sst);
-            }
-            level_0_vec.push_back(new_sstable);
-            ss_layers.at(0) = Layer();
-        } else {
-            auto ssts = getSortedSSTfileNames(l0_dir);
-            for (auto &sst : ssts) {
-                SSTable::sstable_type sst_cache;
-                auto ss_path = l0_dir / sst;
-                sst_cache.load(ss_path);
-                level_0_vec.push_back(sst_cache);
-            }
-            level_0_vec.push_back(new_sstable);
-        }
-        // clear the pkvs
-        mergeLayers_Helper(0, level_0_vec);
-        // clear l0 file
-        for (auto &sst : l0_ssts) {
-            auto sst_path = l0_dir / sst;
-            utils::rmfile(sst_path);
+void KVStore::build_ssts(const kEntrys &kes, u64 timeStamp, Layer &ssts) {
+    kEntrys tmp;
+    int ke_num = 0;
+    for (const auto &ke : kes) {
+        tmp.push_back(ke);
+        ++ke_num;
+        if (cal_new_size(ke_num + 1) > max_sz) {
+            ke_num = 0;
+            ssts.push_back(
+                std::make_shared<SSTable::sstable_type>(tmp, timeStamp));
+            tmp.clear();
         }
-    } else {
-        save();
     }
-    // utils::printDir(save_dir);
+    if (!tmp.empty()) {
+        ssts.push_back(std::make_shared<SSTable::sstable_type>(tmp, timeStamp));
+    }
 }
 /**
-@brief convert the kvstore in mem to sstable and vlog. if deleted, the len of
-the kEntry to be saved in sst will be 0
+@brief convert the memtable to sstable. if deleted, the len of the kEntry to
+be saved in sst will be 0
+ * @param  mem
  * @param  sst
- * @param  vl
  */
-void KVStore::convert_sst(SSTable::sstable_type &sst, vLogs &vlog) {
-    auto kvplist = pkvs->get_kvplist();
+void KVStore::convert_sst(const skiplist::skiplist_type &mem,
+                          SSTable::sstable_type &sst) {
+    // NOTE: the pairs are logged in the vlog by put, only their offsets go to
+    // the SSTable
+    // HINT: except the small values, they are inlined and the logged copy is
+    // garbage once the SSTable is saved
+    const size_t inline_size = config::inline_value_size;
+    auto entries = mem.get_entrylist();
     kEntrys kes;
-    for (const auto &[key, value] : kvplist) {
+    kes.reserve(entries.size());
+    for (const auto &[key, value, offset] : entries) {
         TLen len = value == delete_symbol ? 0 : static_cast<TLen>(value.size());
-        TOff offset = vlog.addVlog({.key = key, .vlen = len, .vvalue = value});
+        if (len != 0 && len <= inline_size) {
+            kes.push_back(kEntry::make_inline(key, value));
+            markDead({.key = key, .offset = offset, .len = len});
+            continue;
+        }
         kes.push_back({.key = key, .offset = offset, .len = len});
     }
     auto timeStamp = SSTable::sstable_type::incrTotalID();
@@ -606,23 +1231,23 @@ void KVStore::convert_sst(SSTable::sstable_type &sst, vLogs &vlog) {
 }
 
 /**
-@brief save the sstable cache and the vlog cache to file
+@brief save the memtable to a level 0 sstable file
+ * @param  mem
  */
-void KVStore::save() {
+void KVStore::save(const skiplist::skiplist_type &mem) {
     auto l0_dir = std::filesystem::path(save_dir) / "level_0";
     if (!std::filesystem::exists(l0_dir)) {
-        Log("l0_dir %s does not exist", l0_dir.c_str());
-        return;
+        // HINT: reset removes the level directories
+        utils::mkdir(l0_dir);
     }
     if (!std::filesystem::is_directory(l0_dir)) {
         Log("l0_dir %s is not a directory", l0_dir.c_str());
         return;
     }
-    SSTable::sstable_type new_sstable;
-    convert_sst(new_sstable, vStore);
-    // NOTE: update the cache
+    auto new_sstable = std::make_shared<SSTable::sstable_type>();
+    convert_sst(mem, *new_sstable);
 
-    std::string sst_filename = new_sstable.gen_filename();
+    std::string sst_filename = new_sstable->gen_filename();
 
     auto sst_path = l0_dir / sst_filename;
 
@@ -630,58 +1255,144 @@ void KVStore::save() {
         Log("sstable %s already exists", sst_path.c_str());
         assert(0);
     }
-    new_sstable.save(sst_path);
+    new_sstable->save(sst_path);
+    if (SSTable::sstable_type::lazyMode()) {
+        new_sstable->dropKEntrys(sst_path);
+    }
     if (config::use_cache) {
-        if (ss_layers.size() == 0) {
-            ss_layers.push_back(Layer());
+        // NOTE: publish the next version with the new SSTable
+        Layers layers = currentVersion()->layers;
+        if (layers.size() == 0) {
+            layers.push_back(Layer());
         }
-        ss_layers[0].push_back(new_sstable);
+        layers[0].push_back(std::move(new_sstable));
+        installVersion(std::move(layers));
     }
-    // clear the pkvs
-    pkvs = std::make_unique<skiplist::skiplist_type>();
 }
 
 /**
 @brief simulate the emergence and test persistence
  */
 void KVStore::clearMem() {
-    compaction();
-    pkvs = std::make_unique<skiplist::skiplist_type>();
-    if (config::use_cache)
-        ss_layers = std::vector<Layer>();
+    std::lock_guard gc_lock(gc_mtx);
+    flushAll();
+    waitCompaction();
+    std::unique_lock lock(state_mtx);
+    std::unique_lock vlog_lock(vlog_mtx);
+    std::unique_lock layers_lock(layers_mtx);
+    pkvs = std::make_shared<skiplist::skiplist_type>();
+    installVersion(Layers());
     vStore.clear_mem();
+    coldStore.clear_mem();
     std::fstream ofs(timestamp_path, std::ios::out);
     std::string s = std::to_string(SSTable::sstable_type::getCurID());
     ofs.write(s.c_str(), s.size());
     ofs.close();
 }
 
+/**
+@brief simulate a crash: the memtable is lost without being flushed
+ */
+void KVStore::dropMem() {
+    std::lock_guard gc_lock(gc_mtx);
+    {
+        // HINT: the frozen memtables are left to the flush thread
+        std::unique_lock lock(state_mtx);
+        room_cv.wait(lock, [this]() { return imms.empty(); });
+    }
+    waitCompaction();
+    std::unique_lock lock(state_mtx);
+    std::unique_lock vlog_lock(vlog_mtx);
+    std::unique_lock layers_lock(layers_mtx);
+    pkvs = std::make_shared<skiplist::skiplist_type>();
+    installVersion(Layers());
+    vStore.clear_mem();
+    coldStore.clear_mem();
+}
+
 void KVStore::rebuildMem() {
+    std::lock_guard gc_lock(gc_mtx);
+    {
+        std::unique_lock vlog_lock(vlog_mtx);
+        std::unique_lock lock(layers_mtx);
+        rebuildLayers();
+    }
+    // NOTE: then the pairs logged after the last flush
+    replayLog();
+}
+/**
+@brief reload the levels, the SSTable timestamp and the vlog head and tail,
+vlog_mtx and layers_mtx should be held exclusively
+ */
+void KVStore::rebuildLayers() {
     if (config::use_cache) {
         // NOTE: if the dir exists, load the sstables into cache
+        u64 flushed_id;
+        loadFlushed(flushed_path, &flushed_id);
+        Layers layers;
         int level = 0;
         std::string level_dir = std::filesystem::path(save_dir) / "level_0";
         while (utils::dirExists(level_dir)) {
             ++level;
+            removeTmpFiles(level_dir);
             auto ssts = getSortedSSTfileNames(level_dir);
             Layer level_layer;
             for (auto &ss_name : ssts) {
-                SSTable::sstable_type sst_cache;
+                auto sst_cache = std::make_shared<SSTable::sstable_type>();
                 auto ss_path = std::filesystem::path(level_dir) / ss_name;
-                sst_cache.load(ss_path);
-                level_layer.push_back(sst_cache);
+                try {
+                    sst_cache->load(ss_path);
+                } catch (const std::runtime_error &e) {
+                    // NOTE: a level 0 file newer than the last finished flush
+                    // is a flush the crash cut short, its pairs are after the
+                    // flushed watermark and come back from the vlog
+                    u64 id = std::stoull(ss_name.substr(0, ss_name.find('_')));
+                    if (layers.empty() && id > flushed_id) {
+                        std::cerr << "drop torn sstable " << ss_path << ": "
+                                  << e.what() << std::endl;
+                        std::filesystem::remove(ss_path);
+                        continue;
+                    }
+                    // ATTENTION: any other file holds pairs nothing else has
+                    // (a compaction output or a finished flush), refuse to
+                    // open rather than lose them
+                    std::string msg = "Can not load sstable " +
+                                      ss_path.string() + ": " + e.what();
+                    std::cerr << msg << std::endl;
+                    throw std::runtime_error(msg);
+                }
+                level_layer.push_back(std::move(sst_cache));
             }
             level_dir = (std::filesystem::path(save_dir) / "level_").string() +
                         std::to_string(level);
-            ss_layers.push_back(level_layer);
+            layers.push_back(std::move(level_layer));
         }
+        installVersion(std::move(layers));
     }
     // set the sstable's timestamp
     loadTimeStamp(timestamp_path);
+    // HINT: .timestamp is only written on a clean shutdown, continue after
+    // the newest SSTable
+    u64 next_id = SSTable::sstable_type::getCurID();
+    for (int level = 0; utils::dirExists(levelDir(level)); ++level) {
+        auto ssts = getSortedSSTfileNames(levelDir(level));
+        if (!ssts.empty()) {
+            const auto &newest = ssts.back();
+            next_id = std::max<u64>(
+                next_id, std::stoull(newest.substr(0, newest.find('_'))) + 1);
+        }
+    }
+    SSTable::sstable_type::setCurID(next_id);
 
     // NOTE: set the vlog head and tail
     if (std::filesystem::exists(vStore.getPath())) {
         vStore.reload_mem();
     }
+    if (std::filesystem::exists(coldStore.getPath())) {
+        coldStore.reload_mem();
+    }
 }
-void KVStore::printMem() { pkvs->print(); }
\ No newline at end of file
+void KVStore::printMem() {
+    std::shared_lock lock(state_mtx);
+    pkvs->print();
+}
\ No newline at end of file
@@ -5,32 +5,134 @@
 #include "sstable.h"
 #include "vlog.h"
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
 class KVStore : public KVStoreAPI {
     // You can add your implementation here
-    using Layer = std::vector<SSTable::sstable_type>;
+    // NOTE: an SSTable is never changed once built, levels share it
+    using SSTPtr = std::shared_ptr<SSTable::sstable_type>;
+    using Layer = std::vector<SSTPtr>;
     using Layers = std::vector<Layer>;
+    /**
+     * @brief an immutable snapshot of the levels (cache mode). A reader pins
+     * the current version for a whole get/scan, the flush thread and the
+     * compaction workers build the next one and publish it by swapping the
+     * pointer. An old version (and its SSTables) goes away with its last
+     * reader.
+     */
+    struct Version {
+        Layers layers;
+    };
+    using VersionPtr = std::shared_ptr<const Version>;
+
+    using MemTable = std::shared_ptr<skiplist::skiplist_type>;
 
   private:
-    std::unique_ptr<skiplist::skiplist_type> pkvs;
+    MemTable pkvs;
+    // NOTE: full memtables waiting for the flush thread, oldest at the front.
+    // They are read-only and still consulted by get/scan
+    std::deque<MemTable> imms;
+    // NOTE: the vlog head when each of imms was frozen, all its pairs are
+    // logged before it. Flushing the memtable moves the watermark there
+    std::deque<TOff> imm_ends;
+    // NOTE: the number of immutable memtables dropped so far, guarded by
+    // state_mtx. gc checks it did not change since its lookup
+    u64 dropped_imms = 0;
     const std::string save_dir;
     const std::string timestamp_path;
+    // NOTE: the vlog is the write-ahead log, pairs before this offset are in
+    // the SSTables and the rest is replayed on startup
+    const std::string flushed_path;
     vLogs vStore;
-    Layers ss_layers;
+    // NOTE: the cold stream in save_dir, gc moves the live values here so the
+    // next gc of vStore does not rewrite them again. It is not a write-ahead
+    // log, a pair lands in the SSTables before the old copy is reclaimed
+    vLogs coldStore;
+    VersionPtr current; // NOTE: guarded by version_mtx
+    mutable std::mutex version_mtx;
+    // NOTE: guards pkvs and imms. shared by put/get/scan (the memtable itself
+    // is concurrent), exclusive when the memtable is swapped out
+    mutable std::shared_mutex state_mtx;
+    // NOTE: serializes the writers of the levels (the flush thread, the
+    // compaction installs, gc) and guards the level directories. Readers only
+    // take it in no-cache mode, in cache mode they pin a Version instead
+    // ATTENTION: lock order is state_mtx -> vlog_mtx -> layers_mtx, the flush
+    // thread never holds state_mtx and layers_mtx both
+    mutable std::shared_mutex layers_mtx;
+    // NOTE: shared by readers while they follow the offsets of their version,
+    // exclusive when gc punches the vlog
+    mutable std::shared_mutex vlog_mtx;
+    std::condition_variable_any flush_cv; // wake up the flush thread
+    std::condition_variable_any room_cv;  // an immutable memtable is flushed
+    bool stop_flush;
+    std::thread flush_thread;
+    // NOTE: compaction workers. A job merges level n into level n + 1 and
+    // marks both busy, so jobs on disjoint level pairs run at the same time
+    // ATTENTION: lock order is compact_mtx -> layers_mtx
+    std::mutex compact_mtx; // guards compacting_levels and stop_compact
+    std::condition_variable compact_cv; // levels changed or a job finished
+    std::set<int> compacting_levels;
+    bool stop_compact;
+    std::vector<std::thread> compact_threads;
+    // NOTE: background gc, wakes up every config::gc_interval_ms and collects
+    // the vlog tail once enough of it is dead. Only started when
+    // config::gc_dead_ratio > 0
+    // (vStore first, then coldStore)
+    // ATTENTION: gc_mtx serializes the gc runs with each other and with
+    // reset/clearMem/rebuildMem, it comes before state_mtx in the lock order
+    std::mutex gc_mtx;
+    std::mutex gc_wait_mtx; // guards stop_gc
+    std::condition_variable gc_cv;
+    bool stop_gc;
+    std::thread gc_thread;
 
     static const size_t max_sz;
 
-    void compaction();
-    void save();
+    void flushLoop();
+    void flushAll();
+    void freeze_locked(TOff end);
+    std::string mem_get(uint64_t key, TOff *offset = nullptr) const;
+    TOff logPut(uint64_t key, const std::string &s);
+    void put_locked(std::unique_lock<std::shared_mutex> &lock, uint64_t key,
+                    const std::string &s, bool wait = true);
+    void put_cold_locked(const std::vector<std::pair<TKey, TValue>> &kvs);
+    void save(const skiplist::skiplist_type &mem);
     size_t cal_new_size();
     static size_t cal_new_size(size_t kv_num);
+    static void build_ssts(const kEntrys &kes, u64 timeStamp, Layer &ssts);
     static int level_limit(int level) { return std::pow(2, level + 1); }
-    void
-    mergeLayers_Helper(int from,
-                       const Layer &src); // overflow pass to the next layer
-    void mergeLayers();
-    void forEachSST(std::function<bool(SSTable::sstable_type &)> func);
+    std::filesystem::path levelDir(int level) const;
+    bool levelExists(int level) const;
+    size_t levelSize(int level) const;
+    Layer loadLayer(int level) const;
+    int pickCompaction() const;
+    void scheduleCompaction();
+    void waitCompaction();
+    void compactionLoop();
+    void gcLoop();
+    void gc_locked(vLogs &store, uint64_t chunk_size);
+    u64 gcLookup(const std::vector<TKey> &keys, std::vector<kEntry> &kes,
+                 std::vector<char> &found, bool state_locked);
+    TValue vquery(kEntry ke);
+    void markDead(const kEntry &ke);
+    void markReplaced(uint64_t key, const skiplist::replaced &old);
+    void runCompaction(int from); // overflow pass to the next layer
+    VersionPtr currentVersion() const;
+    void installVersion(Layers layers);
+    void forEachSST(const Version &version,
+                    std::function<bool(SSTable::sstable_type &)> func);
     static void loadTimeStamp(const std::string &path);
+    static TOff loadFlushed(const std::string &path,
+                            u64 *last_id = nullptr);
+    void saveFlushed(TOff offset);
+    void replayLog();
+    void rebuildLayers();
 
   public:
     static const std::string delete_symbol;
@@ -53,9 +155,11 @@ class KVStore : public KVStoreAPI {
               std::list<std::pair<uint64_t, std::string>> &list) override;
 
     void gc(uint64_t chunk_size) override;
-    void convert_sst(SSTable::sstable_type &sst, vLogs &vl);
+    void convert_sst(const skiplist::skiplist_type &mem,
+                     SSTable::sstable_type &sst);
     // test-only
     void printMem();
     void clearMem();
+    void dropMem();
     void rebuildMem();
 };
@@ -29,6 +29,9 @@ protected:
     config::ConfigParam newConfig = {0, 0, false, false};
     config::reConfig(newConfig);
     cout << "use cache:" << config::use_cache << endl;
+    // HINT: start from scratch, a store left by another test may be written
+    // with another config (e.g. the bf size) and fail to open
+    std::filesystem::remove_all(testdir);
     pStore = make_unique<KVStore>(testdir, vLog.string());
     pStore->reset();
     if (!utils::dirExists(testdir))
@@ -55,6 +58,9 @@ protected:
     GC_EXPECT(cur_offset, last_offset, size);
     std::cout << "check_gc over" << std::endl;
   }
+  // NOTE: the config knobs a test changes are put back when it ends, even
+  // by a failed ASSERT_*. Declared first, so pStore is gone by then
+  config::Snapshot saved_config;
   std::filesystem::path testdir = "../tmp";
   std::filesystem::path vLog = testdir / "vlog";
   std::unique_ptr<KVStore> pStore;
@@ -1,10 +1,14 @@
 #include "../kvstore.h"
 #include "../skiplist.h"
 #include "../utils.h"
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <gtest/gtest.h>
 #include <random>
+#include <set>
 #include <string>
+#include <thread>
 using std::string, std::vector, std::cout, std::endl, config::ConfigParam;
 #define GC_EXPECT(cur, last, size)                                             \
     gc_expect<decltype(last)>((cur), (last), (size), __FILE__, __LINE__)
@@ -23,6 +27,9 @@ class KVStoreTest : public ::testing::Test {
     void SetUp() override {
         // Code here will be called immediately after the constructor (right
         // before each test).
+        // HINT: start from scratch, a store left by another test may be
+        // written with another config (e.g. the bf size) and fail to open
+        std::filesystem::remove_all(testdir);
         pStore = make_unique<KVStore>(testdir, vLog.string());
         pStore->reset();
         if (!utils::dirExists(testdir))
@@ -49,6 +56,9 @@ class KVStoreTest : public ::testing::Test {
         GC_EXPECT(cur_offset, last_offset, size);
         std::cout << "check_gc over" << std::endl;
     }
+    // NOTE: the config knobs a test changes are put back when it ends, even
+    // by a failed ASSERT_*. Declared first, so pStore is gone by then
+    config::Snapshot saved_config;
     std::filesystem::path testdir = "../tmp";
     std::filesystem::path vLog = testdir / "vlog";
     std::unique_ptr<KVStore> pStore;
@@ -910,6 +920,274 @@ TEST_F(KVStoreTest, simulatedPersistence) {
         ASSERT_EQ(pStore->get(i), i % 2 == 0 ? "" : std::to_string(i));
     }
 }
+TEST_F(KVStoreTest, CrashRecovery) {
+    // NOTE: the memtables are lost unflushed, the pairs come back from the
+    // vlog after the flushed watermark
+    int max = 3000;
+    for (int i = 0; i < max; ++i) {
+        pStore->put(i, std::to_string(i));
+    }
+    for (int i = 0; i < max; i += 3) {
+        pStore->del(i);
+    }
+    pStore->put(1, "overwritten");
+    pStore->dropMem();
+    pStore->rebuildMem();
+
+    for (int i = 0; i < max; ++i) {
+        std::string expect = i % 3 == 0 ? "" : std::to_string(i);
+        ASSERT_EQ(pStore->get(i), i == 1 ? "overwritten" : expect);
+    }
+    // HINT: and again on a reopened store
+    pStore->put(max, "last");
+    pStore->dropMem();
+    pStore.reset();
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    ASSERT_EQ(pStore->get(max), "last");
+    ASSERT_EQ(pStore->get(2), "2");
+    ASSERT_EQ(pStore->get(3), "");
+}
+TEST_F(KVStoreTest, CorruptedSSTableOnOpen) {
+    // NOTE: only a level 0 file of a flush that did not finish is dropped on
+    // open, any other SSTable that fails to load fails the open
+    const int max = 2048;
+    for (int i = 0; i < max; ++i) {
+        pStore->put(i, std::to_string(i) + std::string(32, 'x'));
+    }
+    pStore.reset();
+    auto corrupt = [](const std::filesystem::path &path) {
+        // HINT: a file cut short has no footer
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        ofs << std::string(100, 'x');
+    };
+    // HINT: a torn flush, newer than the last finished one
+    auto torn = testdir / "level_0" /
+                (std::to_string(SSTable::sstable_type::getCurID() + 10) +
+                 "_0~10.sst");
+    corrupt(torn);
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    EXPECT_FALSE(std::filesystem::exists(torn));
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), std::to_string(i) + std::string(32, 'x'));
+    }
+    pStore.reset();
+    // HINT: an output of a compaction the crash cut short, its inputs are
+    // still in place
+    auto stray = testdir / "level_1" /
+                 (std::to_string(SSTable::sstable_type::getCurID() + 10) +
+                  "_0~10.sst.tmp");
+    corrupt(stray);
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    EXPECT_FALSE(std::filesystem::exists(stray));
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), std::to_string(i) + std::string(32, 'x'));
+    }
+    pStore.reset();
+    // NOTE: a compaction output is the only copy of its pairs
+    std::filesystem::path victim;
+    for (const auto &file :
+         std::filesystem::directory_iterator(testdir / "level_1")) {
+        victim = file.path();
+    }
+    corrupt(victim);
+    EXPECT_THROW(make_unique<KVStore>(testdir, vLog.string()),
+                 std::runtime_error);
+    EXPECT_TRUE(std::filesystem::exists(victim));
+    std::filesystem::remove_all(testdir);
+}
+TEST_F(KVStoreTest, ColdStream) {
+    // NOTE: gc moves the live values to the cold stream, the hot vlog only
+    // grows with the user writes
+    int max = 2000;
+    for (int i = 0; i < max; ++i) {
+        pStore->put(i, std::to_string(i) + std::string(32, 'a'));
+    }
+    for (int i = 0; i < max; i += 2) {
+        pStore->put(i, std::to_string(i) + std::string(32, 'b'));
+    }
+    auto expect = [](int i) {
+        return std::to_string(i) + std::string(32, i % 2 == 0 ? 'b' : 'a');
+    };
+    auto hot_size = std::filesystem::file_size(vLog);
+    auto cold_path = testdir / "cold.vlog";
+    for (int i = 0; i < 64 && utils::seek_data_block(vLog.string()) <
+                                  static_cast<off_t>(hot_size);
+         ++i) {
+        pStore->gc(16 * KB);
+    }
+    EXPECT_EQ(std::filesystem::file_size(vLog), hot_size);
+    EXPECT_GT(std::filesystem::file_size(cold_path), 0);
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), expect(i));
+    }
+    // HINT: the moved values are not moved again by the next gc of the hot
+    // vlog, only the one live pair of this round is
+    auto cold_size = std::filesystem::file_size(cold_path);
+    for (int i = 0; i < 1000; ++i) {
+        pStore->put(max, std::to_string(i));
+    }
+    pStore->gc(64 * KB);
+    EXPECT_LT(std::filesystem::file_size(cold_path), cold_size + 64);
+    ASSERT_EQ(pStore->get(max), "999");
+    pStore.reset();
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    std::list<std::pair<uint64_t, std::string>> list;
+    pStore->scan(0, max - 1, list);
+    ASSERT_EQ(list.size(), max);
+    for (const auto &[key, value] : list) {
+        ASSERT_EQ(value, expect(key));
+    }
+}
+TEST_F(KVStoreTest, InlineValues) {
+    // NOTE: the small values live in the SSTables once flushed, they are
+    // still read after the whole vlog is punched
+    pStore.reset();
+    // HINT: a value has at most the 8 bytes of the kEntry offset field
+    config::inline_value_size = 16;
+    EXPECT_THROW(KVStore(testdir, vLog.string()), std::runtime_error);
+    config::inline_value_size = 8;
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    int max = 2000;
+    for (int i = 0; i < max; ++i) {
+        pStore->put(i, std::to_string(i));
+        pStore->put(max + i, std::to_string(i) + std::string(32, 'a'));
+    }
+    for (int i = 0; i < max; i += 3) {
+        pStore->del(i);
+    }
+    pStore.reset();
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    utils::de_alloc_file(vLog.string(), 0, std::filesystem::file_size(vLog));
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), i % 3 == 0 ? "" : std::to_string(i));
+        ASSERT_EQ(pStore->get(max + i), "");
+    }
+    std::list<std::pair<uint64_t, std::string>> list;
+    pStore->scan(0, max - 1, list);
+    ASSERT_EQ(list.size(), max - (max + 2) / 3);
+    for (const auto &[key, value] : list) {
+        ASSERT_EQ(value, std::to_string(key));
+    }
+}
+TEST_F(KVStoreTest, SegmentedVlog) {
+    // NOTE: gc reclaims whole segment files of a segmented vlog
+    pStore.reset();
+    std::filesystem::remove_all(testdir);
+    config::vlog_segment_size = 16 * KB;
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    auto count_segments = [this]() {
+        int n = 0;
+        for (const auto &entry : std::filesystem::directory_iterator(vLog)) {
+            n += entry.path().extension() == ".vlog";
+        }
+        return n;
+    };
+    int max = 4096;
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < max; ++i) {
+            pStore->put(i, std::to_string(i) + std::string(64, 'a' + round));
+        }
+    }
+    int before = count_segments();
+    EXPECT_GT(before, 4);
+    for (int i = 0; i < 8; ++i) {
+        pStore->gc(32 * KB);
+    }
+    EXPECT_LT(count_segments(), before);
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), std::to_string(i) + std::string(64, 'b'));
+    }
+    pStore.reset();
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    for (int i = 0; i < max; i += 7) {
+        ASSERT_EQ(pStore->get(i), std::to_string(i) + std::string(64, 'b'));
+    }
+    pStore.reset();
+    std::filesystem::remove_all(testdir);
+}
+TEST_F(KVStoreTest, BackgroundGC) {
+    // NOTE: the gc thread collects the vlog tail once compactions have
+    // dropped enough overwritten pairs, without any gc() call
+    pStore.reset();
+    std::filesystem::remove_all(testdir);
+    config::gc_dead_ratio = 0.3;
+    config::gc_region_size = 16 * KB;
+    config::gc_interval_ms = 50;
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    int max = 4096;
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 0; i < max; ++i) {
+            pStore->put(i, std::to_string(i) + std::string(64, 'a' + round));
+        }
+    }
+    bool collected = false;
+    for (int i = 0; i < 100 && !collected; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        collected = utils::seek_data_block(vLog.string()) > 0;
+    }
+    EXPECT_TRUE(collected);
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), std::to_string(i) + std::string(64, 'd'));
+    }
+    pStore.reset();
+    std::filesystem::remove_all(testdir);
+}
+TEST_F(KVStoreTest, HotKeyGC) {
+    // NOTE: overwrites within one memtable never reach a compaction, the
+    // replaced vlog entries are counted by put and the gc thread runs
+    pStore.reset();
+    std::filesystem::remove_all(testdir);
+    config::gc_dead_ratio = 0.5;
+    config::gc_region_size = 16 * KB;
+    config::gc_interval_ms = 50;
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    const int times = 4096;
+    for (int i = 0; i < times; ++i) {
+        pStore->put(1, std::to_string(i) + std::string(64, 'a'));
+    }
+    bool collected = false;
+    for (int i = 0; i < 100 && !collected; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        collected = utils::seek_data_block(vLog.string()) > 0;
+    }
+    EXPECT_TRUE(collected);
+    EXPECT_EQ(pStore->get(1), std::to_string(times - 1) + std::string(64, 'a'));
+    pStore.reset();
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    EXPECT_EQ(pStore->get(1), std::to_string(times - 1) + std::string(64, 'a'));
+    pStore.reset();
+    std::filesystem::remove_all(testdir);
+}
+TEST_F(KVStoreTest, GCDuringWrites) {
+    // NOTE: gc looks the chunk up without blocking the writers, a write it
+    // races must still win over the value gc moves
+    constexpr int max = 2048;
+    constexpr int rounds = 6;
+    for (int i = 0; i < max; ++i) {
+        pStore->put(i, std::to_string(i) + "_0" + std::string(32, 'x'));
+    }
+    std::atomic<bool> done(false);
+    std::thread writer([this, &done]() {
+        for (int round = 1; round < rounds; ++round) {
+            for (int i = 0; i < max; ++i) {
+                pStore->put(i, std::to_string(i) + "_" +
+                                   std::to_string(round) +
+                                   std::string(32, 'x'));
+            }
+        }
+        done = true;
+    });
+    while (!done) {
+        pStore->gc(16 * KB);
+    }
+    writer.join();
+    pStore->gc(16 * KB);
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), std::to_string(i) + "_" +
+                                      std::to_string(rounds - 1) +
+                                      std::string(32, 'x'));
+    }
+}
 TEST_F(KVStoreTest, smallPersisWithGC) {
     int max = 10;
     for (int i = 0; i < max; ++i) {
@@ -1162,3 +1440,259 @@ TEST_F(KVStoreTest, fullRandomTest) {
         }
     };
 }
+
+TEST_F(KVStoreTest, ConcurrentPutGet) {
+    constexpr int thread_num = 4;
+    constexpr int per_thread = 2000;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < thread_num; ++t) {
+        workers.emplace_back([this, t]() {
+            for (int i = 0; i < per_thread; ++i) {
+                uint64_t key = t + i * thread_num;
+                pStore->put(key, std::to_string(key));
+                // HINT: read back what this thread wrote while others flush
+                if (i % 100 == 0) {
+                    EXPECT_EQ(pStore->get(key), std::to_string(key));
+                }
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    for (uint64_t key = 0; key < thread_num * per_thread; ++key) {
+        ASSERT_EQ(pStore->get(key), std::to_string(key));
+    }
+}
+
+TEST_F(KVStoreTest, ImmutableMemtableOverride) {
+    // NOTE: let several memtables queue up so get/scan have to merge them
+    config::max_immutable_num = 8;
+    const int max = 1024;
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < max; ++i) {
+            pStore->put(i, std::to_string(i) + "_" + std::to_string(round));
+        }
+    }
+    for (int i = 0; i < max; i += 3) {
+        pStore->del(i);
+    }
+    std::list<std::pair<uint64_t, std::string>> list_stu;
+    pStore->scan(0, max - 1, list_stu);
+    ASSERT_EQ(list_stu.size(), max - (max + 2) / 3);
+    for (auto &[key, value] : list_stu) {
+        ASSERT_NE(key % 3, 0);
+        ASSERT_EQ(value, std::to_string(key) + "_2");
+        ASSERT_EQ(pStore->get(key), value);
+    }
+}
+
+TEST_F(KVStoreTest, BackgroundCompaction) {
+    // NOTE: overwrite and delete across several levels while the workers merge
+    config::compaction_threads = 4;
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    const int max = 4096;
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 0; i < max; ++i) {
+            pStore->put(i, std::to_string(i) + "_" + std::to_string(round));
+        }
+    }
+    for (int i = 0; i < max; i += 5) {
+        pStore->del(i);
+    }
+    // HINT: the destructor waits until every level is within its limit
+    pStore.reset();
+    for (int level = 0;; ++level) {
+        auto dir = testdir / ("level_" + std::to_string(level));
+        if (!utils::dirExists(dir)) {
+            break;
+        }
+        vector<string> files;
+        utils::scanDir(dir, files);
+        EXPECT_LE(files.size(), 1u << (level + 1)) << dir;
+    }
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), i % 5 == 0 ? "" : std::to_string(i) + "_3");
+    }
+}
+
+TEST_F(KVStoreTest, Subcompactions) {
+    // NOTE: split every merge into shards, the result should not change
+    config::max_subcompactions = 4;
+    config::subcompaction_min_entries = 1;
+    const int max = 4096;
+    for (int round = 0; round < 3; ++round) {
+        for (int i = round; i < max; i += 2) {
+            pStore->put(i, std::to_string(i) + "_" + std::to_string(round));
+        }
+    }
+    for (int i = 0; i < max; i += 7) {
+        pStore->del(i);
+    }
+    auto expect = [](int i) -> std::string {
+        if (i % 7 == 0) {
+            return "";
+        }
+        return std::to_string(i) + (i % 2 == 0 ? "_2" : "_1");
+    };
+    for (int i = 0; i < max; ++i) {
+        ASSERT_EQ(pStore->get(i), expect(i));
+    }
+    std::list<std::pair<uint64_t, std::string>> list_stu;
+    pStore->scan(0, max - 1, list_stu);
+    ASSERT_EQ(list_stu.size(), max - (max + 6) / 7);
+    for (auto &[key, value] : list_stu) {
+        ASSERT_EQ(value, expect(key));
+    }
+}
+
+TEST_F(KVStoreTest, ReadDuringCompaction) {
+    // NOTE: readers pin a version while the writer keeps the workers busy
+    const int stable = 1024;
+    for (int i = 0; i < stable; ++i) {
+        pStore->put(i, std::to_string(i));
+    }
+    std::atomic<bool> done(false);
+    std::thread writer([this, &done, stable]() {
+        for (int i = stable; i < 16 * stable; ++i) {
+            pStore->put(i, std::to_string(i));
+        }
+        done = true;
+    });
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 2; ++t) {
+        readers.emplace_back([this, &done, t, stable]() {
+            for (int round = 0; !done || round == 0; ++round) {
+                for (int i = t; i < stable; i += 7) {
+                    ASSERT_EQ(pStore->get(i), std::to_string(i));
+                }
+                std::list<std::pair<uint64_t, std::string>> list_stu;
+                pStore->scan(0, stable - 1, list_stu);
+                ASSERT_EQ(list_stu.size(), stable);
+            }
+        });
+    }
+    writer.join();
+    for (auto &r : readers) {
+        r.join();
+    }
+    for (int i = 0; i < 16 * stable; i += 3) {
+        ASSERT_EQ(pStore->get(i), std::to_string(i));
+    }
+}
+
+TEST_F(KVStoreTest, MmapLoad) {
+    // NOTE: the SSTables are read through their mappings, in both modes
+    config::mmap_sst = true;
+    int max = 4096;
+    auto check = [this, &max]() {
+        for (int i = 0; i < max; ++i) {
+            ASSERT_EQ(pStore->get(i),
+                      i % 3 == 0 ? "" : std::to_string(i) + "_1");
+        }
+        std::list<std::pair<uint64_t, std::string>> list_stu;
+        pStore->scan(0, max - 1, list_stu);
+        ASSERT_EQ(list_stu.size(), max - (max + 2) / 3);
+    };
+    for (bool use_cache : {true, false}) {
+        config::use_cache = use_cache;
+        // HINT: no-cache mode loads the SSTables on every read, keep it small
+        max = use_cache ? 4096 : 512;
+        pStore.reset();
+        std::filesystem::remove_all(testdir);
+        pStore = make_unique<KVStore>(testdir, vLog.string());
+        for (int round = 0; round < 2; ++round) {
+            for (int i = 0; i < max; ++i) {
+                pStore->put(i, std::to_string(i) + "_" + std::to_string(round));
+            }
+        }
+        for (int i = 0; i < max; i += 3) {
+            pStore->del(i);
+        }
+        check();
+        pStore.reset();
+        pStore = make_unique<KVStore>(testdir, vLog.string());
+        check();
+        pStore.reset();
+    }
+    std::filesystem::remove_all(testdir);
+}
+TEST_F(KVStoreTest, LazyLoad) {
+    // NOTE: only the header, the BF and the fences of each SSTable in memory
+    config::lazy_load = true;
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    const int max = 4096;
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < max; ++i) {
+            pStore->put(i, std::to_string(i) + "_" + std::to_string(round));
+        }
+    }
+    for (int i = 0; i < max; i += 3) {
+        pStore->del(i);
+    }
+    auto check = [this, max]() {
+        for (int i = 0; i < max; ++i) {
+            ASSERT_EQ(pStore->get(i),
+                      i % 3 == 0 ? "" : std::to_string(i) + "_1");
+        }
+        std::list<std::pair<uint64_t, std::string>> list_stu;
+        pStore->scan(0, max - 1, list_stu);
+        ASSERT_EQ(list_stu.size(), max - (max + 2) / 3);
+    };
+    check();
+    // HINT: reopen, the levels are rebuilt from the files lazily
+    pStore.reset();
+    pStore = make_unique<KVStore>(testdir, vLog.string());
+    check();
+}
+TEST_F(KVStoreTest, LazyCompactionNoOverlap) {
+    // NOTE: compactions over lazy SSTables must find every intersecting dst
+    // table, else a level >= 1 keeps two versions of a key
+    for (bool mmap : {false, true}) {
+        config::lazy_load = !mmap;
+        config::mmap_sst = mmap;
+        pStore.reset();
+        std::filesystem::remove_all(testdir);
+        pStore = make_unique<KVStore>(testdir, vLog.string());
+        const int max = 4096;
+        for (int round = 0; round < 3; ++round) {
+            for (int i = 0; i < max; ++i) {
+                pStore->put(i, std::to_string(i) + "_" + std::to_string(round));
+            }
+        }
+        for (int i = 0; i < max; i += 3) {
+            pStore->del(i);
+        }
+        // HINT: the destructor flushes and waits for the compactions
+        pStore.reset();
+        int levels = 0;
+        for (int level = 1;
+             utils::dirExists(testdir / ("level_" + std::to_string(level)));
+             ++level) {
+            auto dir = testdir / ("level_" + std::to_string(level));
+            std::set<TKey> keys;
+            for (const auto &file : std::filesystem::directory_iterator(dir)) {
+                if (file.path().extension() != ".sst") {
+                    continue;
+                }
+                SSTable::sstable_type sst;
+                sst.load(file.path());
+                auto kes = sst.getKEntrys();
+                for (const auto &ke : *kes) {
+                    EXPECT_TRUE(keys.insert(ke.key).second)
+                        << "key " << ke.key << " twice in level " << level;
+                }
+            }
+            ++levels;
+        }
+        EXPECT_GE(levels, 2);
+        pStore = make_unique<KVStore>(testdir, vLog.string());
+        for (int i = 0; i < max; ++i) {
+            ASSERT_EQ(pStore->get(i),
+                      i % 3 == 0 ? "" : std::to_string(i) + "_2");
+        }
+        pStore.reset();
+    }
+    std::filesystem::remove_all(testdir);
+}
@@ -1,5 +1,6 @@
 #include "../sstable.h"
 #include "../type.h"
+#include "../utils.h"
 #include <gtest/gtest.h>
 class SSTableTest : public ::testing::Test {
 protected:
@@ -23,6 +24,9 @@ protected:
       std::filesystem::remove_all(save_dir);
     }
   }
+  // NOTE: the config knobs a test changes are put back when it ends, even
+  // by a failed ASSERT_*
+  config::Snapshot saved_config;
   kEntrys kes;
 
   SSTable::sstable_type sstable;
@@ -37,8 +41,10 @@ TEST_F(SSTableTest, defaultSize) {
 }
 
 TEST_F(SSTableTest, defaultCalSize) {
+  // NOTE: one block for 10 kEntrys, plus its handle and the footer
   EXPECT_EQ(SSTable::sstable_type::cal_size(10),
-            10 * sizeof(kEntry) + 32 + 8 * 1024);
+            10 * sizeof(kEntry) + 32 + 8 * 1024 +
+                sizeof(SSTable::BlockHandle) + sizeof(SSTable::Footer));
 }
 
 #include <fstream> // Include the necessary header file
@@ -83,4 +89,455 @@ TEST_F(SSTableTest, saveLoadTest) {
   EXPECT_EQ(h1.getMinKey(), 0);
   EXPECT_EQ(h1.getMaxKey(), 9);
   EXPECT_EQ(h1.getNumOfKV(), 10);
-}
\ No newline at end of file
+}
+
+TEST_F(SSTableTest, lazyLoadTest) {
+  // NOTE: a bigger table so the fence index has several blocks
+  kEntrys big;
+  for (int i = 0; i < 1000; ++i) {
+    big.push_back({static_cast<TKey>(2 * i), static_cast<TOff>(i),
+                   static_cast<TLen>(i + 1)});
+  }
+  SSTable::sstable_type table(big, 1);
+  table.save(save_path);
+  auto old_lazy = config::lazy_load;
+  auto old_interval = config::fence_interval;
+  config::lazy_load = true;
+  config::fence_interval = 16;
+  SSTable::sstable_type lazy;
+  lazy.load(save_path);
+  config::lazy_load = old_lazy;
+  config::fence_interval = old_interval;
+  ASSERT_TRUE(lazy.isLazy());
+  ASSERT_EQ(lazy.getKEntryNum(), big.size());
+  // HINT: the file can be unlinked while the table is still in use
+  std::filesystem::remove(save_path);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(lazy.query(2 * i), big[i]);
+    EXPECT_EQ(lazy.query(2 * i + 1), type::ke_not_found);
+  }
+  kEntrys res;
+  lazy.scan(31, 401, res);
+  ASSERT_EQ(res.size(), 185);
+  EXPECT_EQ(res.front(), big[16]);
+  EXPECT_EQ(res.back(), big[200]);
+  EXPECT_EQ(*lazy.getKEntrys(), big);
+}
+
+TEST_F(SSTableTest, queryBatchTest) {
+  kEntrys big;
+  for (int i = 0; i < 1000; ++i) {
+    big.push_back({static_cast<TKey>(2 * i), static_cast<TOff>(i),
+                   static_cast<TLen>(i + 1)});
+  }
+  SSTable::sstable_type table(big, 1);
+  table.save(save_path);
+  auto old_lazy = config::lazy_load;
+  auto old_interval = config::fence_interval;
+  config::lazy_load = true;
+  config::fence_interval = 16;
+  SSTable::sstable_type lazy;
+  lazy.load(save_path);
+  config::lazy_load = old_lazy;
+  config::fence_interval = old_interval;
+  // NOTE: odd keys are missing, key 10 is already resolved by a newer table
+  std::vector<TKey> keys;
+  for (TKey key = 0; key < 2100; key += 5) {
+    keys.push_back(key);
+  }
+  for (const auto *sst : {&table, &lazy}) {
+    std::vector<kEntry> res(keys.size(), type::ke_not_found);
+    std::vector<char> found(keys.size(), 0);
+    found[2] = 1;
+    size_t hit = sst->queryBatch(keys, res, found);
+    size_t expect = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      bool exist = keys[i] % 2 == 0 && keys[i] < 2000 && i != 2;
+      expect += exist;
+      EXPECT_EQ(res[i], exist ? big[keys[i] / 2] : type::ke_not_found);
+      EXPECT_EQ(found[i], exist || i == 2);
+    }
+    EXPECT_EQ(hit, expect);
+  }
+}
+
+TEST_F(SSTableTest, keyIndexTest) {
+  // NOTE: the sorted and the Eytzinger layout, sizes around the scan width,
+  // the SIMD lanes and full trees, odd keys are missing
+  for (u64 eytzinger_min : {static_cast<u64>(-1), static_cast<u64>(0)}) {
+    for (u64 n : {0, 1, 2, 7, 15, 16, 17, 33, 100, 1000, 4095, 4097}) {
+      kEntrys kes;
+      for (u64 i = 0; i < n; ++i) {
+        kes.push_back({2 * i + 2, i, static_cast<TLen>(i + 1)});
+      }
+      KeyIndex index(kes, eytzinger_min);
+      EXPECT_EQ(index.size(), n);
+      EXPECT_EQ(index.isEytzinger(), eytzinger_min == 0 && n > 0);
+      for (u64 i = 0; i < n; ++i) {
+        EXPECT_EQ(index.find(2 * i + 2), i);
+        EXPECT_EQ(index.find(2 * i + 1), KeyIndex::npos);
+      }
+      EXPECT_EQ(index.find(0), KeyIndex::npos);
+      EXPECT_EQ(index.find(2 * n + 3), KeyIndex::npos);
+      EXPECT_EQ(index.find(std::numeric_limits<TKey>::max()), KeyIndex::npos);
+    }
+    // HINT: keys differing only in one 32-bit half
+    kEntrys kes = {{1, 0, 1}, {1ULL << 32, 0, 1}, {(1ULL << 32) + 1, 0, 1}};
+    KeyIndex index(kes, eytzinger_min);
+    EXPECT_EQ(index.find(1), 0);
+    EXPECT_EQ(index.find(1ULL << 32), 1);
+    EXPECT_EQ(index.find((1ULL << 32) + 1), 2);
+    EXPECT_EQ(index.find((1ULL << 33) + 1), KeyIndex::npos);
+    EXPECT_EQ(index.find(2), KeyIndex::npos);
+  }
+
+  kEntrys big;
+  for (int i = 0; i < 1000; ++i) {
+    big.push_back({static_cast<TKey>(3 * i), static_cast<TOff>(i),
+                   static_cast<TLen>(i + 1)});
+  }
+  SSTable::sstable_type table(big, 1);
+  for (int i = 0; i < 3000; ++i) {
+    EXPECT_EQ(table.query(i), i % 3 == 0 ? big[i / 3] : type::ke_not_found);
+  }
+  table.save(save_path);
+  // NOTE: the loaded table builds its index in Eytzinger order
+  auto old_min = config::eytzinger_min_keys;
+  config::eytzinger_min_keys = 1;
+  SSTable::sstable_type loaded;
+  loaded.load(save_path);
+  config::eytzinger_min_keys = old_min;
+  for (int i = 0; i < 3000; ++i) {
+    EXPECT_EQ(loaded.query(i), i % 3 == 0 ? big[i / 3] : type::ke_not_found);
+  }
+}
+
+TEST_F(SSTableTest, blockFormatTest) {
+  kEntrys big;
+  for (int i = 0; i < 1000; ++i) {
+    big.push_back({static_cast<TKey>(2 * i), static_cast<TOff>(i),
+                   static_cast<TLen>(i + 1)});
+  }
+  auto old_interval = config::fence_interval;
+  config::fence_interval = 16;
+  SSTable::sstable_type table(big, 1);
+  table.save(save_path);
+  config::fence_interval = old_interval;
+  // NOTE: the footer ends the file and points to the block index
+  SSTable::Footer footer;
+  {
+    std::ifstream ifs(save_path, std::ios::binary | std::ios::ate);
+    u64 file_size = ifs.tellg();
+    ifs.seekg(file_size - sizeof(footer));
+    ifs.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    EXPECT_EQ(footer.magic, SSTable::footer_magic);
+    EXPECT_EQ(footer.version, SSTable::format_version);
+    EXPECT_EQ(footer.block_num, (1000 + 15) / 16);
+    EXPECT_EQ(footer.block_entries, 16);
+    EXPECT_EQ(footer.index_offset + footer.block_num *
+                                        sizeof(SSTable::BlockHandle) +
+                  sizeof(footer),
+              file_size);
+  }
+  // HINT: the blocks keep their size when loaded with another fence_interval
+  auto old_lazy = config::lazy_load;
+  config::lazy_load = true;
+  SSTable::sstable_type lazy;
+  lazy.load(save_path);
+  config::lazy_load = old_lazy;
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(lazy.query(2 * i), big[i]);
+  }
+  // NOTE: the sequential keys are delta encoded, far below 24 bytes a kEntry
+  u64 data_start =
+      sizeof(SSTable::Header) + SSTable::sstable_type::getBFSize() / 8;
+  EXPECT_LT(footer.index_offset - data_start, big.size() * sizeof(kEntry) / 3);
+  // NOTE: flip a byte of the block holding kEntry 100 (key 200)
+  SSTable::BlockHandle handle;
+  {
+    std::ifstream ifs(save_path, std::ios::binary);
+    ifs.seekg(footer.index_offset + 100 / 16 * sizeof(handle));
+    ifs.read(reinterpret_cast<char *>(&handle), sizeof(handle));
+  }
+  EXPECT_EQ(handle.first_key, 2 * (100 / 16 * 16));
+  u64 corrupt_at = handle.offset + 1;
+  {
+    std::fstream fs(save_path, std::ios::binary | std::ios::in | std::ios::out);
+    fs.seekg(corrupt_at);
+    char c;
+    fs.read(&c, 1);
+    fs.seekp(corrupt_at);
+    c = static_cast<char>(~c);
+    fs.write(&c, 1);
+  }
+  // HINT: the blocks are cached by file, a reopen would get the good ones
+  // read above (the rewrite may even share their mtime tick)
+  SSTable::sstable_type::blockCache().clear();
+  SSTable::sstable_type eager;
+  EXPECT_THROW(eager.load(save_path), std::runtime_error);
+  // NOTE: a lazy read of the corrupted block fails loudly instead of taking
+  // the key for missing (an older SSTable would answer with a stale value)
+  for (bool mmap : {false, true}) {
+    auto old_mmap = config::mmap_sst;
+    config::lazy_load = !mmap;
+    config::mmap_sst = mmap;
+    SSTable::sstable_type torn;
+    torn.load(save_path);
+    config::lazy_load = old_lazy;
+    config::mmap_sst = old_mmap;
+    EXPECT_THROW((void)torn.query(200), std::runtime_error);
+    kEntrys res;
+    EXPECT_THROW(torn.scan(190, 210, res), std::runtime_error);
+    EXPECT_EQ(torn.query(2 * 200), big[200]);
+  }
+  // HINT: a file cut short has no footer
+  std::filesystem::resize_file(save_path, footer.index_offset + 10);
+  SSTable::sstable_type cut;
+  EXPECT_THROW(cut.load(save_path), std::runtime_error);
+}
+
+TEST_F(SSTableTest, mmapTest) {
+  kEntrys big;
+  for (int i = 0; i < 1000; ++i) {
+    big.push_back({static_cast<TKey>(2 * i), static_cast<TOff>(i),
+                   static_cast<TLen>(i + 1)});
+  }
+  auto old_interval = config::fence_interval;
+  config::fence_interval = 16;
+  SSTable::sstable_type table(big, 1);
+  table.save(save_path);
+  config::fence_interval = old_interval;
+  auto old_mmap = config::mmap_sst;
+  config::mmap_sst = true;
+  SSTable::sstable_type mapped;
+  mapped.load(save_path);
+  config::mmap_sst = old_mmap;
+  ASSERT_TRUE(mapped.isLazy());
+  // HINT: the mapping stays valid after the file is unlinked
+  std::filesystem::remove(save_path);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(mapped.query(2 * i), big[i]);
+    EXPECT_EQ(mapped.query(2 * i + 1), type::ke_not_found);
+  }
+  kEntrys res;
+  mapped.scan(31, 401, res);
+  ASSERT_EQ(res.size(), 185);
+  EXPECT_EQ(res.front(), big[16]);
+  EXPECT_EQ(res.back(), big[200]);
+  EXPECT_EQ(*mapped.getKEntrys(), big);
+  // NOTE: a copy shares the mapping
+  SSTable::sstable_type copy(mapped);
+  mapped.clear();
+  EXPECT_EQ(copy.query(500), big[250]);
+}
+
+TEST_F(SSTableTest, varintTest) {
+  std::vector<u64> values = {0,
+                             1,
+                             127,
+                             128,
+                             300,
+                             (1ULL << 32) - 1,
+                             (1ULL << 56) + 5,
+                             (1ULL << 63) | 1234,
+                             std::numeric_limits<u64>::max()};
+  TBytes bytes;
+  for (auto v : values) {
+    utils::putVarint64(bytes, v);
+  }
+  EXPECT_EQ(bytes.size(), 1 + 1 + 1 + 2 + 2 + 5 + 9 + 10 + 10);
+  // HINT: both the word at a time path and the tail bytes path
+  for (size_t pad : {0, 16}) {
+    TBytes buf = bytes;
+    buf.resize(bytes.size() + pad);
+    const u8 *p = buf.data();
+    const u8 *end = buf.data() + bytes.size();
+    for (auto v : values) {
+      u64 got = 0;
+      p = utils::getVarint64(p, end, got);
+      ASSERT_NE(p, nullptr);
+      EXPECT_EQ(got, v);
+    }
+    EXPECT_EQ(p, end);
+  }
+  // NOTE: a cut off varint
+  u64 got;
+  EXPECT_EQ(utils::getVarint64(bytes.data() + bytes.size() - 3,
+                               bytes.data() + bytes.size() - 1, got),
+            nullptr);
+}
+
+TEST_F(SSTableTest, legacyFormatTest) {
+  // NOTE: a v1 file, | Header | BF | kEntrys |
+  sstable.save(save_path);
+  {
+    auto bf = sstable.getBF().toBytes();
+    auto header = sstable.getHeader();
+    std::ofstream ofs(save_path, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<char *>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<char *>(bf.data()), bf.size());
+    for (const auto &ke : kes) {
+      ofs.write(reinterpret_cast<const char *>(&ke), sizeof(ke));
+    }
+  }
+  for (bool lazy_load : {false, true}) {
+    auto old_lazy = config::lazy_load;
+    config::lazy_load = lazy_load;
+    SSTable::sstable_type table;
+    table.load(save_path);
+    config::lazy_load = old_lazy;
+    for (int i = 0; i < 10; ++i) {
+      EXPECT_EQ(table.query(i), kes[i]);
+    }
+    EXPECT_EQ(*table.getKEntrys(), kes);
+  }
+}
+
+TEST_F(SSTableTest, footerBeforeSizeTest) {
+  // NOTE: 8 kEntrys of 16 bytes encoded (1-byte key delta, 10-byte offset,
+  // 5-byte len) plus the restarts, the index and the footer make up 8 * 24
+  // bytes, the size of a v1 file of 8 kEntrys
+  kEntrys odd;
+  for (int i = 0; i < 8; ++i) {
+    odd.push_back({static_cast<TKey>(i), (1ULL << 63) | i, 1U << 30});
+  }
+  auto old_interval = config::fence_interval;
+  config::fence_interval = 16;
+  SSTable::sstable_type table(odd, 1);
+  table.save(save_path);
+  config::fence_interval = old_interval;
+  u64 kes_offset =
+      sizeof(SSTable::Header) + SSTable::sstable_type::getBFSize() / 8;
+  ASSERT_EQ(std::filesystem::file_size(save_path),
+            kes_offset + odd.size() * sizeof(kEntry));
+  for (bool lazy_load : {false, true}) {
+    auto old_lazy = config::lazy_load;
+    config::lazy_load = lazy_load;
+    SSTable::sstable_type loaded;
+    loaded.load(save_path);
+    config::lazy_load = old_lazy;
+    EXPECT_EQ(*loaded.getKEntrys(), odd);
+  }
+  // HINT: no footer and not the size of a v1 file either
+  std::filesystem::resize_file(save_path, kes_offset + 100);
+  SSTable::sstable_type bad;
+  EXPECT_THROW(bad.load(save_path), std::runtime_error);
+}
+
+TEST_F(SSTableTest, restartSeekTest) {
+  // NOTE: a lazy point lookup seeks the restart points of the cached block,
+  // every key between two stored ones must miss (no BF to filter them)
+  config::use_bf = false;
+  config::fence_interval = 64;
+  kEntrys big;
+  for (int i = 0; i < 1000; ++i) {
+    big.push_back({static_cast<TKey>(3 * i + 1), static_cast<TOff>(i),
+                   static_cast<TLen>(i % 7)});
+  }
+  SSTable::sstable_type table(big, 1);
+  table.save(save_path);
+  for (bool mmap : {false, true}) {
+    config::lazy_load = !mmap;
+    config::mmap_sst = mmap;
+    SSTable::sstable_type lazy;
+    lazy.load(save_path);
+    for (TKey key = 0; key < 3002; ++key) {
+      auto expect = key % 3 == 1 ? big[key / 3] : type::ke_not_found;
+      EXPECT_EQ(lazy.query(key), expect) << "key " << key;
+    }
+  }
+}
+
+TEST_F(SSTableTest, blockCacheRewriteTest) {
+  // NOTE: a file written again right after the old one is closed and removed
+  // likely gets its inode and mtime tick, with the same size and timestamp.
+  // The crc of the block index still keeps its blocks apart
+  kEntrys big;
+  for (int i = 0; i < 256; ++i) {
+    big.push_back({static_cast<TKey>(i), static_cast<TOff>(i),
+                   static_cast<TLen>(1)});
+  }
+  config::fence_interval = 16;
+  config::lazy_load = true;
+  for (TLen len : {1, 2}) {
+    big[20].len = len;
+    std::filesystem::remove(save_path);
+    SSTable::sstable_type(big, 1).save(save_path);
+    SSTable::sstable_type lazy;
+    lazy.load(save_path);
+    EXPECT_EQ(lazy.query(20), big[20]);
+  }
+}
+
+TEST_F(SSTableTest, lruCacheTest) {
+  // NOTE: one shard, 3 entries of 1 byte
+  ShardedLRUCache<int, std::string> cache(3, 1);
+  for (int i = 0; i < 3; ++i) {
+    cache.insert(i, std::make_shared<std::string>(std::to_string(i)), 1);
+  }
+  ASSERT_EQ(*cache.lookup(0), "0"); // 0 is the most recent now
+  cache.insert(3, std::make_shared<std::string>("3"), 1);
+  EXPECT_EQ(cache.lookup(1), nullptr); // the least recent one is evicted
+  EXPECT_NE(cache.lookup(0), nullptr);
+  EXPECT_NE(cache.lookup(3), nullptr);
+  EXPECT_EQ(cache.usage(), 3);
+  EXPECT_EQ(cache.hits(), 3);
+  EXPECT_EQ(cache.misses(), 1);
+  cache.insert(4, std::make_shared<std::string>("too big"), 4);
+  EXPECT_EQ(cache.lookup(4), nullptr);
+  cache.setCapacity(1);
+  EXPECT_EQ(cache.usage(), 1);
+  EXPECT_NE(cache.lookup(3), nullptr);
+}
+
+TEST_F(SSTableTest, blockCacheTest) {
+  kEntrys big;
+  for (int i = 0; i < 256; ++i) {
+    big.push_back({static_cast<TKey>(i), static_cast<TOff>(i),
+                   static_cast<TLen>(1)});
+  }
+  // HINT: the blocks are cut when the file is saved
+  auto old_lazy = config::lazy_load;
+  auto old_interval = config::fence_interval;
+  config::fence_interval = 16;
+  SSTable::sstable_type table(big, 1);
+  table.save(save_path);
+  config::lazy_load = true;
+  SSTable::sstable_type lazy;
+  lazy.load(save_path);
+  config::lazy_load = old_lazy;
+  config::fence_interval = old_interval;
+
+  auto &cache = SSTable::sstable_type::blockCache();
+  cache.resetStats();
+  EXPECT_EQ(lazy.query(5), big[5]); // miss, block 0 is read
+  EXPECT_EQ(lazy.query(7), big[7]); // hit
+  EXPECT_EQ(cache.hits(), 1);
+  EXPECT_EQ(cache.misses(), 1);
+  kEntrys res;
+  lazy.scan(0, 40, res); // block 0 hits, block 1 and 2 miss
+  ASSERT_EQ(res.size(), 41);
+  EXPECT_EQ(cache.hits(), 2);
+  EXPECT_EQ(cache.misses(), 3);
+
+  // NOTE: another open of the same file (no-cache mode loads the SSTables on
+  // every get) finds the blocks read through the first one
+  config::lazy_load = true;
+  SSTable::sstable_type reopened;
+  reopened.load(save_path);
+  config::lazy_load = old_lazy;
+  EXPECT_EQ(reopened.query(20), big[20]); // hit, block 1
+  EXPECT_EQ(cache.hits(), 3);
+  EXPECT_EQ(cache.misses(), 3);
+  // HINT: a rewritten file is a new one, its blocks are not the cached ones
+  big[20].len = 2;
+  SSTable::sstable_type rewritten(big, 1);
+  std::filesystem::remove(save_path);
+  rewritten.save(save_path);
+  config::lazy_load = true;
+  SSTable::sstable_type fresh;
+  fresh.load(save_path);
+  config::lazy_load = old_lazy;
+  EXPECT_EQ(fresh.query(20), big[20]);
+  EXPECT_EQ(cache.misses(), 4);
+}
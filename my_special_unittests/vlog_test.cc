@@ -2,12 +2,15 @@
 #include "../utils.h"
 #include "../vlog.h"
 
+#include <csignal>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <gtest/gtest.h>
 #include <memory>
 #include <string>
+#include <sys/resource.h>
+#include <thread>
 class vLogTest : public ::testing::Test {
 protected:
   void SetUp() override {
@@ -27,6 +30,9 @@ protected:
       std::filesystem::remove_all("../tmp");
     }
   }
+  // NOTE: the config knobs a test changes are put back when it ends, even
+  // by a failed ASSERT_*. Declared first, so vl is gone by then
+  config::Snapshot saved_config;
   TPath vpath;
   std::unique_ptr<vLogs> vl;
 };
@@ -230,6 +236,28 @@ TEST_F(vLogTest, gcWithReloc) {
   EXPECT_EQ(vl->getTail(), 5 * 16 - 13);
 }
 
+TEST_F(vLogTest, deadBytesAfterPartialGC) {
+  config::gc_region_size = 1024;
+  vl->clear();
+  // NOTE: 128 entries of 16 bytes, region 0 holds the first 64
+  std::vector<TOff> offs;
+  for (int i = 0; i < 128; ++i) {
+    offs.push_back(vl->addVlog({static_cast<TKey>(i), 1, "a"}));
+  }
+  for (int i = 0; i < 64; ++i) {
+    vl->markDead(offs[i], 1);
+  }
+  EXPECT_EQ(vl->deadBytes(), 1024);
+  // HINT: half of region 0 is reclaimed, so is half of its dead count
+  vl->gc(512);
+  EXPECT_EQ(vl->deadBytes(), 512);
+  vl->gc(768);
+  EXPECT_EQ(vl->deadBytes(), 256);
+  vl->gc(1024);
+  EXPECT_EQ(vl->deadBytes(), 0);
+  EXPECT_EQ(vl->gcChunk(0.1, 4), 0);
+}
+
 TEST_F(vLogTest, persistenceTest) {
   vl->clear();
   for (int i = 0; i < 10; ++i) {
@@ -249,4 +277,334 @@ TEST_F(vLogTest, persistenceTest) {
   }
   EXPECT_EQ(vl->getTail(), 0);
   EXPECT_EQ(vl->getHead(), 16 * 10);
-}
\ No newline at end of file
+}
+
+TEST_F(vLogTest, valueCacheTest) {
+  auto old_size = config::value_cache_size;
+  config::value_cache_size = 1024 * 1024;
+  vl = std::make_unique<vLogs>(vpath);
+  config::value_cache_size = old_size;
+  vl->clear();
+  std::vector<TOff> offs;
+  for (int i = 0; i < 10; ++i) {
+    offs.push_back(vl->addVlog({static_cast<TKey>(i),
+                                static_cast<TLen>(std::to_string(i).size()),
+                                std::to_string(i)}));
+  }
+  auto &cache = vl->valueCache();
+  for (int round = 0; round < 2; ++round) {
+    for (int i = 0; i < 10; ++i) {
+      kEntry ke = {.key = static_cast<TKey>(i), .offset = offs[i], .len = 1};
+      EXPECT_EQ(vl->query(ke), std::to_string(i));
+    }
+  }
+  EXPECT_EQ(cache.misses(), 10);
+  EXPECT_EQ(cache.hits(), 10);
+  // HINT: a collected value is not served from the cache
+  vl->gc(offs[5]);
+  kEntry old_ke = {.key = 0, .offset = offs[0], .len = 1};
+  EXPECT_EQ(vl->query(old_ke), "");
+  // HINT: offsets are reused after clear
+  vl->clear();
+  TOff off = vl->addVlog({0, 1, "x"});
+  ASSERT_EQ(off, offs[0]);
+  EXPECT_EQ(vl->query({.key = 0, .offset = off, .len = 1}), "x");
+  // HINT: nothing is written at the head yet
+  EXPECT_EQ(vl->query({.key = 0, .offset = vl->getHead(), .len = 1}), "");
+  // HINT: a disabled cache is not even looked up
+  vl.reset();
+  vl = std::make_unique<vLogs>(vpath);
+  ASSERT_EQ(vl->valueCache().getCapacity(), 0);
+  EXPECT_EQ(vl->query({.key = 0, .offset = off, .len = 1}), "x");
+  EXPECT_EQ(vl->valueCache().misses(), 0);
+}
+
+TEST_F(vLogTest, concurrentQueryTest) {
+  vl->clear();
+  std::vector<TOff> offs;
+  for (int i = 0; i < 1000; ++i) {
+    std::string value(i % 300 + 1, 'a' + i % 26);
+    offs.push_back(vl->addVlog(
+        {static_cast<TKey>(i), static_cast<TLen>(value.size()), value}));
+  }
+  // NOTE: readers share the descriptor, pread keeps no stream position
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([this, &offs, t]() {
+      for (int i = t; i < 1000; i += 4) {
+        std::string value(i % 300 + 1, 'a' + i % 26);
+        kEntry ke = {.key = static_cast<TKey>(i),
+                     .offset = offs[i],
+                     .len = static_cast<TLen>(value.size())};
+        EXPECT_EQ(vl->query(ke), value);
+      }
+    });
+  }
+  for (auto &r : readers) {
+    r.join();
+  }
+}
+
+TEST_F(vLogTest, binaryValueAndResync) {
+  vl->clear();
+  // NOTE: the value holds the magic byte, the decoder relies on vlen + crc
+  const std::string bin("\xff\x00\xff value \xff", 10);
+  std::vector<std::string> values = {"first", bin, "third"};
+  std::vector<TOff> offs;
+  for (int i = 0; i < 3; ++i) {
+    offs.push_back(vl->addVlog({static_cast<TKey>(i),
+                                static_cast<TLen>(values[i].size()),
+                                values[i]}));
+  }
+  for (int i = 0; i < 3; ++i) {
+    kEntry ke = {.key = static_cast<TKey>(i),
+                 .offset = offs[i],
+                 .len = static_cast<TLen>(values[i].size())};
+    EXPECT_EQ(vl->query(ke), values[i]);
+  }
+  // HINT: flip a value byte of the second entry, the crc catches it
+  {
+    std::fstream fs(vpath, std::ios::in | std::ios::out | std::ios::binary);
+    fs.seekp(offs[1] + 15 + 4);
+    fs.put('X');
+  }
+  EXPECT_EQ(vl->query({.key = 1, .offset = offs[1], .len = 10}), "");
+  EXPECT_EQ(vl->query({.key = 2, .offset = offs[2], .len = 5}), "third");
+  // HINT: readVlogs skips the corrupted entry and goes on
+  vEntrys ves;
+  std::vector<TOff> locs;
+  auto size = vl->readVlogs(0, ves, 1 << 20, locs);
+  EXPECT_EQ(size, vl->getHead());
+  ASSERT_EQ(ves.size(), 2);
+  EXPECT_EQ(ves.front().vvalue, "first");
+  EXPECT_EQ(ves.back().vvalue, "third");
+  EXPECT_EQ(locs[1], offs[2]);
+}
+
+TEST_F(vLogTest, addVlogsBatch) {
+  vl->clear();
+  std::vector<vEntryProps> vs;
+  for (int i = 0; i < 100; ++i) {
+    // HINT: every 10th entry is a tombstone, logged with the key only
+    std::string value = i % 10 == 0 ? "" : std::string(i, 'a' + i % 26);
+    vs.push_back({static_cast<TKey>(i), static_cast<TLen>(value.size()),
+                  value});
+  }
+  auto offs = vl->addVlogs(vs);
+  ASSERT_EQ(offs.size(), vs.size());
+  EXPECT_EQ(offs[1], offs[0] + 15);
+  EXPECT_EQ(vl->getHead(), std::filesystem::file_size(vpath));
+  for (int i = 0; i < 100; ++i) {
+    if (vs[i].vlen == 0) {
+      continue;
+    }
+    kEntry ke = {.key = vs[i].key, .offset = offs[i], .len = vs[i].vlen};
+    EXPECT_EQ(vl->query(ke), vs[i].vvalue);
+  }
+  // NOTE: the batch is byte-identical to single appends
+  std::ifstream ifs(vpath, std::ios::binary);
+  std::string batched((std::istreambuf_iterator<char>(ifs)),
+                      std::istreambuf_iterator<char>());
+  ifs.close();
+  vl->clear();
+  for (const auto &v : vs) {
+    vl->addVlog(v);
+  }
+  ifs.open(vpath, std::ios::binary);
+  std::string single((std::istreambuf_iterator<char>(ifs)),
+                     std::istreambuf_iterator<char>());
+  EXPECT_EQ(batched, single);
+}
+
+TEST_F(vLogTest, syncModes) {
+  for (auto mode : {config::SyncMode::batch, config::SyncMode::periodic}) {
+    vl.reset();
+    config::sync_mode = mode;
+    vl = std::make_unique<vLogs>(vpath);
+    vl->clear();
+    std::vector<vEntryProps> vs;
+    for (int i = 0; i < 64; ++i) {
+      vs.push_back({static_cast<TKey>(i), 16, std::string(16, 'a' + i % 26)});
+    }
+    auto offs = vl->addVlogs(vs);
+    TOff off = vl->addVlog({64, 5, "hello"});
+    vl->sync();
+    EXPECT_EQ(vl->query({.key = 64, .offset = off, .len = 5}), "hello");
+    // HINT: reopen, the destructor syncs and stops the periodic thread
+    vl.reset();
+    vl = std::make_unique<vLogs>(vpath);
+    for (int i = 0; i < 64; ++i) {
+      EXPECT_EQ(vl->query({.key = vs[i].key, .offset = offs[i], .len = 16}),
+                vs[i].vvalue);
+    }
+  }
+}
+
+TEST_F(vLogTest, groupCommit) {
+  vl.reset();
+  config::sync_mode = config::SyncMode::batch;
+  vl = std::make_unique<vLogs>(vpath);
+  vl->clear();
+  u64 syncs = vl->syncNum();
+  // NOTE: the puts that queue behind a syncing leader share its next group
+  constexpr int threads = 8;
+  constexpr int per_thread = 200;
+  std::vector<std::vector<TOff>> offs(threads);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < threads; ++t) {
+    writers.emplace_back([this, &offs, t]() {
+      for (int i = 0; i < per_thread; ++i) {
+        TKey key = t * per_thread + i;
+        std::string value(key % 50 + 1, 'a' + key % 26);
+        offs[t].push_back(
+            vl->addVlog({key, static_cast<TLen>(value.size()), value}));
+      }
+    });
+  }
+  for (auto &w : writers) {
+    w.join();
+  }
+  EXPECT_LT(vl->syncNum() - syncs, threads * per_thread);
+  EXPECT_EQ(vl->getHead(), std::filesystem::file_size(vpath));
+  for (int t = 0; t < threads; ++t) {
+    for (int i = 0; i < per_thread; ++i) {
+      TKey key = t * per_thread + i;
+      std::string value(key % 50 + 1, 'a' + key % 26);
+      EXPECT_EQ(vl->query({.key = key,
+                           .offset = offs[t][i],
+                           .len = static_cast<TLen>(value.size())}),
+                value);
+    }
+  }
+}
+
+TEST_F(vLogTest, failedAppend) {
+  // NOTE: a file size limit makes the write stop halfway, then fail (EFBIG)
+  std::signal(SIGXFSZ, SIG_IGN);
+  for (auto mode : {config::SyncMode::none, config::SyncMode::batch}) {
+    vl.reset();
+    config::sync_mode = mode;
+    vl = std::make_unique<vLogs>(vpath);
+    vl->clear();
+    TOff first = vl->addVlog({1, 5, "hello"});
+    u64 head = vl->getHead();
+    rlimit old_limit{};
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    rlimit limit = old_limit;
+    limit.rlim_cur = head + 100;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    std::string big(1000, 'b');
+    EXPECT_THROW(vl->addVlog({2, static_cast<TLen>(big.size()), big}),
+                 std::runtime_error);
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    // HINT: the torn part is cut off, the next entry starts at the old head
+    EXPECT_EQ(vl->getHead(), head);
+    EXPECT_EQ(std::filesystem::file_size(vpath), head);
+    TOff off = vl->addVlog({3, static_cast<TLen>(big.size()), big});
+    EXPECT_EQ(off, head);
+    EXPECT_EQ(vl->query({.key = 1, .offset = first, .len = 5}), "hello");
+    EXPECT_EQ(vl->query({.key = 3,
+                         .offset = off,
+                         .len = static_cast<TLen>(big.size())}),
+              big);
+  }
+  std::signal(SIGXFSZ, SIG_DFL);
+}
+
+TEST_F(vLogTest, segmentedVlog) {
+  // NOTE: 64-byte segments hold 4 entries of 16 bytes
+  vl.reset();
+  std::filesystem::remove_all(vpath);
+  config::vlog_segment_size = 64;
+  vl = std::make_unique<vLogs>(vpath);
+  ASSERT_TRUE(std::filesystem::is_directory(vpath));
+  for (int i = 0; i < 20; ++i) {
+    vl->addVlog({static_cast<TKey>(i), 1, std::to_string(i % 10)});
+  }
+  auto count_segments = [this]() {
+    int n = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(vpath)) {
+      n += entry.path().extension() == ".vlog";
+    }
+    return n;
+  };
+  EXPECT_EQ(vl->segmentNum(), 5);
+  EXPECT_EQ(count_segments(), 5);
+  EXPECT_EQ(vl->segmentPath(5 * 16), vl->segmentPath(7 * 16));
+  EXPECT_NE(vl->segmentPath(3 * 16), vl->segmentPath(4 * 16));
+  for (int i = 0; i < 20; ++i) {
+    kEntry ke = {.key = static_cast<TKey>(i),
+                 .offset = static_cast<TOff>(i * 16),
+                 .len = 1};
+    EXPECT_EQ(vl->query(ke), std::to_string(i % 10));
+  }
+  // HINT: a read goes on across the segments
+  vEntrys ves;
+  std::vector<TOff> locs;
+  EXPECT_EQ(vl->readVlogs(0, ves, 1 << 20, locs), 20 * 16);
+  EXPECT_EQ(ves.size(), 20);
+  // NOTE: gc deletes the segments wholly behind the tail
+  vl->gc(9 * 16);
+  EXPECT_EQ(vl->segmentNum(), 3);
+  EXPECT_EQ(count_segments(), 3);
+  for (int i = 0; i < 20; ++i) {
+    kEntry ke = {.key = static_cast<TKey>(i),
+                 .offset = static_cast<TOff>(i * 16),
+                 .len = 1};
+    EXPECT_EQ(vl->query(ke), i < 9 ? "" : std::to_string(i % 10));
+  }
+  // HINT: the tail comes back from the manifest
+  vl = std::make_unique<vLogs>(vpath);
+  EXPECT_EQ(vl->getTail(), 9 * 16);
+  EXPECT_EQ(vl->getHead(), 20 * 16);
+  EXPECT_EQ(vl->query({.key = 15, .offset = 15 * 16, .len = 1}), "5");
+  vl->clear();
+  EXPECT_EQ(vl->segmentNum(), 1);
+  EXPECT_EQ(count_segments(), 1);
+}
+
+TEST_F(vLogTest, checkpointTest) {
+  vl->clear();
+  for (int i = 0; i < 10; ++i) {
+    vl->addVlog({static_cast<TKey>(i), 1, std::to_string(i)});
+  }
+  vl->gc(5 * 16);
+  // HINT: closing writes the checkpoint
+  vl.reset();
+  TPath ckpt = vpath;
+  ckpt += ".ckpt";
+  std::ifstream ifs(ckpt);
+  TOff saved_tail = 0, saved_head = 0;
+  ifs >> saved_tail >> saved_head;
+  EXPECT_EQ(saved_tail, 5 * 16);
+  EXPECT_EQ(saved_head, 10 * 16);
+  // NOTE: a torn append after the checkpoint is cut on open
+  {
+    std::ofstream ofs(vpath, std::ios::binary | std::ios::app);
+    ofs.write("\xff\x01\x02\x03", 4);
+  }
+  vl = std::make_unique<vLogs>(vpath);
+  EXPECT_EQ(vl->getTail(), 5 * 16);
+  EXPECT_EQ(vl->getHead(), 10 * 16);
+  EXPECT_EQ(std::filesystem::file_size(vpath), 10 * 16);
+  TOff off = vl->addVlog({10, 1, "x"});
+  EXPECT_EQ(off, 10 * 16);
+  EXPECT_EQ(vl->query({.key = 10, .offset = off, .len = 1}), "x");
+  EXPECT_EQ(vl->query({.key = 7, .offset = 7 * 16, .len = 1}), "7");
+  // NOTE: so is one with no checkpoint to start from, the entries are walked
+  // from the tail
+  vl.reset();
+  std::filesystem::remove(ckpt);
+  {
+    std::ofstream ofs(vpath, std::ios::binary | std::ios::app);
+    char torn[] = {static_cast<char>(vLogs::magic), 0x01, 0x02, 0x03};
+    ofs.write(torn, sizeof(torn));
+  }
+  vl = std::make_unique<vLogs>(vpath);
+  EXPECT_EQ(vl->getTail(), 5 * 16);
+  EXPECT_EQ(vl->getHead(), 11 * 16);
+  EXPECT_EQ(std::filesystem::file_size(vpath), 11 * 16);
+  off = vl->addVlog({11, 1, "y"});
+  EXPECT_EQ(off, 11 * 16);
+  EXPECT_EQ(vl->query({.key = 11, .offset = off, .len = 1}), "y");
+}
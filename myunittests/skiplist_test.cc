@@ -2,6 +2,7 @@
 #include <gtest/gtest.h>
 #include <list>
 #include <numeric>
+#include <thread>
 #include <utility>
 class SkipListTest : public ::testing::Test {
 protected:
@@ -85,3 +86,57 @@ TEST_F(SkipListTest, BasicScan) {
   empty.push_front(std::make_pair(endkey, sl.get(endkey)));
   EXPECT_EQ(sl.scan(endkey, endkey), empty);
 }
+
+TEST_F(SkipListTest, OverwriteAndArena) {
+  skiplist::skiplist_type list;
+  EXPECT_EQ(list.memoryUsage() > 0, true);
+  for (int i = 0; i < 100; ++i) {
+    list.put(7, std::to_string(i));
+  }
+  EXPECT_EQ(list.size(), 1);
+  EXPECT_EQ(list.get(7), "99");
+  list.put(7, "");
+  EXPECT_EQ(list.get(7), "");
+  std::string large(64 * 1024, 'x');
+  auto before = list.memoryUsage();
+  list.put(8, large);
+  EXPECT_EQ(list.get(8), large);
+  EXPECT_GE(list.memoryUsage(), before + large.size());
+}
+
+TEST_F(SkipListTest, ConcurrentPutGet) {
+  skiplist::skiplist_type list;
+  constexpr int thread_num = 4;
+  constexpr int per_thread = 2000;
+  std::vector<std::thread> writers;
+  for (int t = 0; t < thread_num; ++t) {
+    writers.emplace_back([&list, t]() {
+      for (int i = 0; i < per_thread; ++i) {
+        uint64_t key = t + i * thread_num;
+        list.put(key, std::to_string(key));
+        // HINT: every writer also overwrites a shared hot key
+        list.put(0, std::to_string(t));
+      }
+    });
+  }
+  // NOTE: readers never block, a found key always has a complete value
+  std::thread reader([&list]() {
+    for (int i = 0; i < per_thread; ++i) {
+      auto v = list.get(i);
+      if (v != "" && i != 0) {
+        EXPECT_EQ(v, std::to_string(i));
+      }
+    }
+  });
+  for (auto &w : writers) {
+    w.join();
+  }
+  reader.join();
+  EXPECT_EQ(list.size(), thread_num * per_thread);
+  for (uint64_t key = 1; key < thread_num * per_thread; ++key) {
+    EXPECT_EQ(list.get(key), std::to_string(key));
+  }
+  auto keys = list.get_keylist();
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  EXPECT_EQ(keys.size(), thread_num * per_thread);
+}
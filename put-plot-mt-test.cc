@@ -0,0 +1,92 @@
+#include "kvstore.h"
+#include "utils.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+using std::cout, std::endl, std::string;
+// NOTE: multi-writer variant of put-plot-test, run the same put workload with
+// 1, 2, 4, ... max_threads writers and report the throughput of each round
+string random_str(int n) {
+  // NOTE: rand() takes a global lock, every writer uses its own generator
+  thread_local std::minstd_rand gen(std::random_device{}());
+  static const string str =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  string new_str;
+  for (int i = 0; i < n; ++i) {
+    new_str.push_back(str[gen() % str.size()]);
+  }
+  return new_str;
+};
+void clean(const string &sst_path, const string &vlog_path) {
+  if (utils::dirExists(sst_path)) {
+    std::filesystem::remove_all(sst_path);
+  }
+  if (std::filesystem::exists(vlog_path)) {
+    std::filesystem::remove_all(vlog_path);
+  }
+}
+/**
+@brief run put_size-byte puts with thread_num writers for max_seconds
+ * @return double average ops/s
+ */
+double run(int thread_num, int put_size, int max_seconds) {
+  string sst_path = "./put-plot-mt/data";
+  string vlog_path = "./put-plot-mt/vlog";
+  clean(sst_path, vlog_path);
+  auto kvs = std::make_shared<KVStore>(sst_path, vlog_path);
+
+  std::atomic<bool> stop_flag(false);
+  std::atomic<u64> number(0);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < thread_num; ++t) {
+    writers.emplace_back([&kvs, &stop_flag, &number, t, thread_num, put_size]() {
+      // HINT: disjoint keys per writer, key = t + i * thread_num
+      for (u64 i = 0; !stop_flag; ++i) {
+        kvs->put(t + i * thread_num, random_str(put_size));
+        number++;
+      }
+    });
+  }
+  u64 total = 0;
+  for (int i = 0; i < max_seconds; ++i) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    u64 cur = number.exchange(0);
+    total += cur;
+    cout << "put(" << thread_num << " threads) throughput: " << cur
+         << " ops/s" << endl
+         << std::flush;
+  }
+  stop_flag = true;
+  for (auto &w : writers) {
+    w.join();
+  }
+  kvs.reset();
+  clean(sst_path, vlog_path);
+  return static_cast<double>(total) / max_seconds;
+}
+int main(int argc, const char *argv[]) {
+  if (argc != 5) {
+    cout << "Usage: ./put-plot-mt-test <put-size> <max_seconds> "
+            "<bf_size>(bytes) <max_threads>"
+         << endl;
+    return 0;
+  }
+  config::ConfigParam config = {atoi(argv[3]) * 8, 3, true, true};
+  config::reConfig(config);
+  const int put_size = atoi(argv[1]);
+  const int max_seconds = atoi(argv[2]);
+  const int max_threads = atoi(argv[4]);
+
+  std::vector<std::pair<int, double>> results;
+  for (int t = 1; t <= max_threads; t *= 2) {
+    results.emplace_back(t, run(t, put_size, max_seconds));
+  }
+  cout << "threads\tavg throughput(ops/s)\tspeedup" << endl;
+  for (auto [t, ops] : results) {
+    cout << t << "\t" << ops << "\t" << ops / results.front().second << endl;
+  }
+  return 0;
+}
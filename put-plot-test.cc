@@ -30,33 +30,22 @@ string random_str(int n) {
   }
   return new_str;
 };
-int main(int argc, const char *argv[]) {
-  if (argc != 4) {
-    cout << "Usage: ./put-plot-test <put-size> <max_seconds> <bf_size>(bytes)"
-         << endl;
-    return 0;
-  }
-
+/**
+@brief run the put workload once with the given sync mode
+ */
+void run_mode(config::SyncMode mode, const string &name, int put_size,
+              int max_seconds) {
   string sst_path = "./put-plot/data";
   string vlog_path = "./put-plot/vlog";
   if (utils::dirExists(sst_path)) {
-    std::vector<std::string> files;
-    utils::scanDir(sst_path, files);
-    for (auto &file : files) {
-      utils::rmfile(sst_path + "/" + file);
-    }
-    utils::rmdir(sst_path);
+    utils::rmDirRecursively(sst_path);
   }
-  if (utils::dirExists(vlog_path)) {
+  if (std::filesystem::exists(vlog_path)) {
     utils::rmfile(vlog_path);
   }
   std::this_thread::sleep_for(std::chrono::seconds(1));
-  config::ConfigParam config = {atoi(argv[3]) * 8, 3, true, true};
-  config::reConfig(config);
+  config::sync_mode = mode;
   std::shared_ptr<KVStore> kvs = std::make_shared<KVStore>(sst_path, vlog_path);
-  const int put_size = atoi(argv[1]);
-  const int max_seconds = atoi(argv[2]);
-  std::vector<std::pair<int, string>> test_kvs;
   auto put_fn = [&kvs, put_size](std::atomic<int> &number,
                                  std::atomic<bool> &stop_flag) {
     while (!stop_flag) {
@@ -65,15 +54,43 @@ int main(int argc, const char *argv[]) {
     }
   };
 
-  run(put_fn, "put", max_seconds);
+  stop_flag = false;
+  run(put_fn, "put(sync=" + name + ")", max_seconds);
+  kvs.reset();
   // delete all files
   if (utils::dirExists(sst_path)) {
-    std::string cmd = "sudo rm -rf " + sst_path;
-    system(cmd.c_str());
+    utils::rmDirRecursively(sst_path);
+  }
+  if (std::filesystem::exists(vlog_path)) {
+    utils::rmfile(vlog_path);
+  }
+}
+int main(int argc, const char *argv[]) {
+  if (argc != 4 && argc != 5) {
+    cout << "Usage: ./put-plot-test <put-size> <max_seconds> <bf_size>(bytes) "
+            "[sync_mode: none|batch|periodic|all]"
+         << endl;
+    return 0;
+  }
+  const std::vector<std::pair<string, config::SyncMode>> modes = {
+      {"none", config::SyncMode::none},
+      {"batch", config::SyncMode::batch},
+      {"periodic", config::SyncMode::periodic}};
+  const string mode_arg = argc == 5 ? argv[4] : "none";
+
+  config::ConfigParam config = {atoi(argv[3]) * 8, 3, true, true};
+  config::reConfig(config);
+  const int put_size = atoi(argv[1]);
+  const int max_seconds = atoi(argv[2]);
+  bool found = false;
+  for (const auto &[name, mode] : modes) {
+    if (mode_arg == name || mode_arg == "all") {
+      found = true;
+      run_mode(mode, name, put_size, max_seconds);
+    }
   }
-  if (utils::dirExists(vlog_path)) {
-    std::string cmd = "sudo rm -rf " + vlog_path;
-    system(cmd.c_str());
+  if (!found) {
+    cout << "Unknown sync mode: " << mode_arg << endl;
   }
   return 0;
-}
\ No newline at end of file
+}
@@ -1,51 +1,155 @@
 #include "skiplist.h"
+#include <cstring>
 #include <iostream>
 #include <list>
+#include <new>
+#include <random>
 namespace skiplist {
 using std::cout;
 using std::endl;
-void skiplist_type::put(key_type key, const value_type &val) {
-    vector<Node *> prev = find_prev(key);
-    // if the key already exist, simply replace the val
-    // NOTE: height start at 0
-    for (int i = height; i >= 0; --i) {
-        if (prev.at(i)->next != tail.at(i) && prev.at(i)->next->key == key) {
-            auto p_equal = prev.at(i)->next;
-            p_equal->value = val;
-            while (p_equal->down != nullptr) {
-                p_equal = p_equal->down;
-                p_equal->value = val;
-            }
-            return;
+skiplist_type::skiplist_type(double p)
+    : p(p), height(1), ele_number(0),
+      head(new_node(0, copy_value("", 0), MAXHEIGHT)) {}
+/**
+@brief copy the value bytes into the arena
+ * @param  val
+ * @param  offset the vlog offset of the pair
+ * @return const Value* the {offset, len, bytes} record
+ */
+const skiplist_type::Value *skiplist_type::copy_value(const value_type &val,
+                                                      uint64_t offset) {
+    char *mem = arena.allocateAligned(sizeof(Value) + val.size());
+    auto *v = new (mem) Value;
+    v->offset = offset;
+    v->len = static_cast<uint32_t>(val.size());
+    std::memcpy(v->data, val.data(), val.size());
+    return v;
+}
+skiplist_type::Node *skiplist_type::new_node(key_type key, const Value *val,
+                                             size_t node_height) {
+    // NOTE: Node already holds next[1]
+    size_t bytes =
+        sizeof(Node) + sizeof(std::atomic<Node *>) * (node_height - 1);
+    char *mem = arena.allocateAligned(bytes);
+    Node *n = new (mem) Node;
+    n->key = key;
+    n->value.store(val, std::memory_order_relaxed);
+    n->height = static_cast<uint32_t>(node_height);
+    for (size_t i = 0; i < node_height; ++i) {
+        new (&n->next[i]) std::atomic<Node *>(nullptr);
+    }
+    return n;
+}
+size_t skiplist_type::roll_size() const {
+    // generate a random number in [1, MAXHEIGHT]
+    // NOTE: rand() takes a global lock, every writer thread rolls its own
+    thread_local std::minstd_rand gen(std::random_device{}());
+    std::uniform_real_distribution<double> dis(0.0, 1.0);
+    size_t layer = 1;
+    while (dis(gen) < this->p && layer < MAXHEIGHT) {
+        layer++;
+    }
+    return layer;
+}
+skiplist_type::Node *skiplist_type::find_greater_or_equal(key_type key) const {
+    Node *cur = head;
+    int level = static_cast<int>(height.load(std::memory_order_relaxed)) - 1;
+    for (int i = level; i >= 0; --i) {
+        Node *next = cur->next[i].load(std::memory_order_acquire);
+        while (next != nullptr && next->key < key) {
+            cur = next;
+            next = cur->next[i].load(std::memory_order_acquire);
+        }
+        // cur->key < key <= next->key
+        if (i == 0) {
+            return next;
         }
     }
-
+    return nullptr; // unreachable, height >= 1
+}
+void skiplist_type::find_splice_for_level(key_type key, Node *before,
+                                          int level, Node **prev,
+                                          Node **next) const {
+    Node *cur = before;
+    Node *nxt = cur->next[level].load(std::memory_order_acquire);
+    while (nxt != nullptr && nxt->key < key) {
+        cur = nxt;
+        nxt = cur->next[level].load(std::memory_order_acquire);
+    }
+    *prev = cur;
+    *next = nxt;
+}
+const skiplist_type::Value *skiplist_type::store_value(Node *node,
+                                                      const Value *val) {
+    // HINT: concurrent writers of a key may get here out of log order, keep
+    // the one with the larger offset so the memtable agrees with a replay
+    // NOTE: offsets of different vlog streams (the top bit) do not compare,
+    // a gc move never races a put, so the later one simply wins
+    const Value *old = node->value.load(std::memory_order_acquire);
+    while ((old->offset ^ val->offset) >> 63 != 0 ||
+           old->offset <= val->offset) {
+        if (node->value.compare_exchange_weak(old, val,
+                                              std::memory_order_release,
+                                              std::memory_order_acquire)) {
+            return old;
+        }
+    }
+    return val;
+}
+/**
+@brief insert or overwrite the pair
+ * @param  offset the vlog offset of the pair
+ * @return replaced the pair logged earlier that is no longer referenced (the
+ * old value, or this one if a later one is already there)
+ */
+replaced skiplist_type::put(key_type key, const value_type &val,
+                            uint64_t offset) {
+    auto lost = [](const Value *v) {
+        return replaced{true, v->offset, std::string_view(v->data, v->len)};
+    };
+    Node *prev[MAXHEIGHT];
+    Node *next[MAXHEIGHT];
     size_t layer = roll_size();
-    vector<Node *> new_node_vec(height + 1, nullptr);
-    for (int i = 0; i <= layer; i++) {
-        if (i > height) {
-            // NOTE: create a new layer
-            // cout << "create new layer: " << i << endl;
-            height = i;
-            head.push_back(new Node(nullptr, nullptr));
-            tail.push_back(new Node(nullptr, nullptr));
-            head.at(i)->down = head.at(i - 1);
-            tail.at(i)->down = tail.at(i - 1);
-            new_node_vec.push_back(
-                new Node(key, val, tail.at(i), head.at(i),
-                         i == 0 ? nullptr : new_node_vec.at(i - 1)));
-            // when i > height, prev[i] is head[i]
-            head.at(i)->next = new_node_vec.at(i);
-            break; // height += 1
+    // NOTE: raise the height first, readers see the new levels through head
+    // whose next is nullptr until a node is linked there
+    size_t max_height = height.load(std::memory_order_relaxed);
+    while (layer > max_height &&
+           !height.compare_exchange_weak(max_height, layer,
+                                         std::memory_order_relaxed)) {
+    }
+    max_height = std::max(max_height, layer);
+    Node *before = head;
+    for (int i = static_cast<int>(max_height) - 1; i >= 0; --i) {
+        find_splice_for_level(key, before, i, &prev[i], &next[i]);
+        before = prev[i];
+    }
+    // if the key already exist, simply replace the val
+    // HINT: the old value bytes stay in the arena until the memtable is dropped
+    if (next[0] != nullptr && next[0]->key == key) {
+        return lost(store_value(next[0], copy_value(val, offset)));
+    }
+
+    Node *n = new_node(key, copy_value(val, offset), layer);
+    for (size_t i = 0; i < layer; ++i) {
+        while (true) {
+            n->next[i].store(next[i], std::memory_order_relaxed);
+            if (prev[i]->next[i].compare_exchange_strong(
+                    next[i], n, std::memory_order_release)) {
+                break;
+            }
+            // NOTE: another writer linked a node here, search again from
+            // prev[i] (keys only move forward)
+            find_splice_for_level(key, prev[i], i, &prev[i], &next[i]);
+            if (i == 0 && next[0] != nullptr && next[0]->key == key) {
+                // HINT: the same key was inserted concurrently, our node is
+                // not linked anywhere yet, so just update the winner
+                return lost(store_value(
+                    next[0], n->value.load(std::memory_order_relaxed)));
+            }
         }
-        Node *new_top = new Node(key, val, nullptr, nullptr,
-                                 i == 0 ? nullptr : new_node_vec.at(i - 1));
-        new_top->next = prev.at(i)->next;
-        prev.at(i)->next = new_top;
-        new_node_vec.at(i) = new_top;
-    }
-    ele_number++;
-    // Now new_node_vec[i] is node in layer i
+    }
+    ele_number.fetch_add(1, std::memory_order_relaxed);
+    return {false, 0, {}};
 }
 /**
 @brief get value by key
@@ -53,62 +157,94 @@ void skiplist_type::put(key_type key, const value_type &val) {
  * @return std::string "" if not found
  */
 std::string skiplist_type::get(key_type key) const {
-    vector<Node *> prev = find_prev(key);
-    Node *node = prev.at(0)->next;
+    Node *node = find_greater_or_equal(key);
     if (node != nullptr && node->key == key) {
-        return node->value;
+        const Value *v = node->value.load(std::memory_order_acquire);
+        return {v->data, v->len};
+    }
+    return "";
+}
+/**
+@brief get value and its vlog offset by key
+ * @param  key
+ * @param  offset set if found
+ * @return std::string "" if not found
+ */
+std::string skiplist_type::get(key_type key, uint64_t &offset) const {
+    Node *node = find_greater_or_equal(key);
+    if (node != nullptr && node->key == key) {
+        const Value *v = node->value.load(std::memory_order_acquire);
+        offset = v->offset;
+        return {v->data, v->len};
     }
     return "";
 }
 void skiplist_type::print() const {
-    for (int i = height; i >= 0; i--) {
-        Node *cur = head.at(i)->next;
+    int level = static_cast<int>(height.load(std::memory_order_relaxed)) - 1;
+    for (int i = level; i >= 0; i--) {
+        Node *cur = head->next[i].load(std::memory_order_acquire);
         cout << "Layer " << i << ": ";
-        while (cur->next != tail.at(i)) {
+        while (cur != nullptr) {
             cout << cur->key << " ";
-            cur = cur->next;
+            cur = cur->next[i].load(std::memory_order_acquire);
         }
         cout << endl;
     }
 }
 
 std::list<key_type> skiplist_type::get_keylist() const {
-    Node *cur = head.at(0)->next;
+    Node *cur = head->next[0].load(std::memory_order_acquire);
     std::list<key_type> keys;
-    while (cur != tail.at(0)) {
+    while (cur != nullptr) {
         keys.push_back(cur->key);
-        cur = cur->next;
+        cur = cur->next[0].load(std::memory_order_acquire);
     }
     return keys;
 }
 std::list<kvpair> skiplist_type::scan(key_type start, key_type end) const {
     // NOTE: [k1, k2]
-
-    Node *cur = head.at(0)->next;
     std::list<kvpair> pairs;
     if (end < start) {
         return pairs;
     }
-    while (cur != tail.at(0)) {
-        if (cur->key >= start && cur->key <= end) {
-            pairs.emplace_back(cur->key, cur->value);
-        }
-        cur = cur->next;
+    Node *cur = find_greater_or_equal(start);
+    while (cur != nullptr && cur->key <= end) {
+        const Value *v = cur->value.load(std::memory_order_acquire);
+        pairs.emplace_back(cur->key, value_type(v->data, v->len));
+        cur = cur->next[0].load(std::memory_order_acquire);
     }
     return pairs;
 }
-uint64_t skiplist_type::size() const { return ele_number; }
+uint64_t skiplist_type::size() const {
+    return ele_number.load(std::memory_order_relaxed);
+}
 /**
 @brief get all key-value pair list
  * @return std::list<kvpair>
  */
 std::list<kvpair> skiplist_type::get_kvplist() const {
-    Node *cur = head.at(0)->next;
+    Node *cur = head->next[0].load(std::memory_order_acquire);
     std::list<kvpair> kvps;
-    while (cur != tail.at(0)) {
-        kvps.emplace_back(cur->key, cur->value);
-        cur = cur->next;
+    while (cur != nullptr) {
+        const Value *v = cur->value.load(std::memory_order_acquire);
+        kvps.emplace_back(cur->key, value_type(v->data, v->len));
+        cur = cur->next[0].load(std::memory_order_acquire);
     }
     return kvps;
 }
+/**
+@brief get all pairs with their vlog offsets, ascending by key
+ * @return std::vector<entry>
+ */
+std::vector<entry> skiplist_type::get_entrylist() const {
+    std::vector<entry> entries;
+    entries.reserve(size());
+    Node *cur = head->next[0].load(std::memory_order_acquire);
+    while (cur != nullptr) {
+        const Value *v = cur->value.load(std::memory_order_acquire);
+        entries.push_back({cur->key, value_type(v->data, v->len), v->offset});
+        cur = cur->next[0].load(std::memory_order_acquire);
+    }
+    return entries;
+}
 } // namespace skiplist
@@ -1,97 +1,90 @@
 #ifndef SKIPLIST_H
 #define SKIPLIST_H
 
+#include "arena.h"
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <list>
 #include <string>
+#include <string_view>
 #include <vector>
 namespace skiplist {
 using key_type = uint64_t;
 using value_type = std::string;
 
 using kvpair = std::pair<key_type, value_type>;
+// NOTE: a pair with the vlog offset it was logged at
+using entry = struct entry {
+  key_type key;
+  value_type value;
+  uint64_t offset;
+};
+// NOTE: what a put replaced, the value bytes stay in the arena until the
+// memtable is dropped. found is false if the key was new
+using replaced = struct replaced {
+  bool found;
+  uint64_t offset;
+  std::string_view value;
+};
 using std::vector;
+/**
+ * @brief concurrent skiplist memtable. put/get/scan can be called by many
+ * threads at once: writers link the towers with CAS, readers never block.
+ */
 class skiplist_type {
 private:
-  // add something here
-  size_t height;
-  double p;
-  uint64_t ele_number;
+  static constexpr size_t MAXHEIGHT = 32;
+  // NOTE: the value is published as one pointer so an overwrite is atomic for
+  // readers, the bytes follow the len inline. offset is where the pair is
+  // logged in the vlog
+  using Value = struct value {
+    uint64_t offset;
+    uint32_t len;
+    char data[1];
+  };
+  // NOTE: one node per key, the tower of next pointers is allocated inline
+  // (next[0] ~ next[height - 1]) and the value bytes live in the arena too
   using Node = struct node {
     key_type key;
-    value_type value;
-    node *next;
-    node *prev;
-    node *down;
-    node(key_type key, value_type value, node *next, node *prev, node *down)
-        : key(key), value(value), next(next), prev(prev), down(down) {}
-    node(node *next, node *prev)
-        : key(0), next(next), prev(prev), down(nullptr) {}
-    node() : key(0), next(nullptr), prev(nullptr), down(nullptr) {}
+    std::atomic<const Value *> value;
+    uint32_t height;
+    std::atomic<node *> next[1];
   };
 
-  vector<Node *> head;
-  vector<Node *> tail;
-  size_t MAXHEIGHT;
-  vector<Node *> find_prev(key_type key) const {
-    // NOTE: return the prev node's array
-    // NOTE: height is index, size = height + 1
-    vector<Node *> node_vec(height + 1, new Node(nullptr, nullptr));
-    size_t level = head.size() - 1;
-    // assert(level == this->height);
-
-    Node *cur = head.at(level);
+  Arena arena;
+  double p;
+  std::atomic<size_t> height; // NOTE: the levels in use, in [1, MAXHEIGHT]
+  std::atomic<uint64_t> ele_number;
+  Node *head;
 
-    cur = head.at(level);
-    for (int i = level; i >= 0; i--) {
-      while (cur->next != tail.at(i) && cur->next->key < key) {
-        cur = cur->next;
-      }
-      // cur->key < key <= cur -> next ->key
-      // found
-      node_vec.at(i) = cur;
-      cur = cur->down;
-    }
-    // level 0
-    return node_vec;
-  }
-  size_t roll_size() {
-    // generate a random number in [1, MAXHEIGHT]
-    // srand(time(NULL));
-    size_t layer = 0;
-    // NOTE: rand() generate a number in [0, RAND_MAX)
-    while (static_cast<double>(rand()) / RAND_MAX < this->p &&
-           layer < this->MAXHEIGHT) {
-      layer++;
-      //   cout << "rand: " << static_cast<double>(rand()) / RAND_MAX << endl;
-      //   cout << "p: " << this->p << endl;
-      //   cout << "layer: " << layer << endl;
-    }
-    return layer;
-  }
+  Node *new_node(key_type key, const Value *val, size_t node_height);
+  const Value *copy_value(const value_type &val, uint64_t offset);
+  // NOTE: return the first node whose key >= key (nullptr if none)
+  Node *find_greater_or_equal(key_type key) const;
+  // NOTE: find prev/next of the key at level, start searching from before
+  void find_splice_for_level(key_type key, Node *before, int level,
+                             Node **prev, Node **next) const;
+  size_t roll_size() const;
+  // NOTE: overwrite the value unless a pair logged later is already there,
+  // return the one that lost (the old value or val itself)
+  static const Value *store_value(Node *node, const Value *val);
 
 public:
-  explicit skiplist_type(double p = 0.5) {
-    this->p = p;
-    this->height = 0;
-    this->MAXHEIGHT = 32;
-    Node *h0 = new Node(nullptr, nullptr);
-    Node *t0 = new Node(nullptr, nullptr);
-    h0->next = t0;
-    t0->prev = h0;
-    this->head.push_back(h0);
-    this->tail.push_back(t0);
-    this->ele_number = 0;
-  }
-  void put(key_type key, const value_type &val);
+  explicit skiplist_type(double p = 0.5);
+  skiplist_type(const skiplist_type &other) = delete;
+  skiplist_type &operator=(const skiplist_type &other) = delete;
+  replaced put(key_type key, const value_type &val, uint64_t offset = 0);
   // std::optional<value_type> get(key_type key) const;
   [[nodiscard]] std::string get(key_type key) const;
+  [[nodiscard]] std::string get(key_type key, uint64_t &offset) const;
   void print() const;
   [[nodiscard]] std::list<key_type> get_keylist() const;
   [[nodiscard]] std::list<kvpair> get_kvplist() const;
+  [[nodiscard]] std::vector<entry> get_entrylist() const;
   [[nodiscard]] std::list<kvpair> scan(key_type start, key_type end) const;
   [[nodiscard]] uint64_t size() const;
+  [[nodiscard]] size_t memoryUsage() const { return arena.memoryUsage(); }
 };
 
 } // namespace skiplist
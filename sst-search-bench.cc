@@ -0,0 +1,88 @@
+#include "keyindex.h"
+#include "type.h"
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+using std::cout, std::endl;
+// NOTE: microbenchmark of the in-memory SSTable point lookup, the recursive
+// binary search over the kEntrys (the search sstable_type::query used before
+// KeyIndex) against KeyIndex::find in the sorted and in the Eytzinger layout,
+// on tables of 2^8 to 2^max_shift keys
+u64 binary_search_helper(TKey key, u64 left, u64 right, const kEntrys &kes,
+                         bool &found) {
+  if (left == right) {
+    found = kes[left].key == key;
+    return found ? left : -1;
+  }
+  u64 mid = (left + right) / 2;
+  if (kes[mid].key == key) {
+    found = true;
+    return mid;
+  }
+  if (kes[mid].key > key) {
+    return binary_search_helper(key, left, mid, kes, found);
+  }
+  return binary_search_helper(key, mid + 1, right, kes, found);
+}
+/**
+@brief run func on every key and time it
+ * @return double ns per lookup
+ */
+template <typename Func>
+double timeIt(const std::vector<TKey> &keys, Func func, u64 &checksum) {
+  auto start = std::chrono::steady_clock::now();
+  for (auto key : keys) {
+    checksum += func(key);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         keys.size();
+}
+int main(int argc, const char *argv[]) {
+  if (argc != 3) {
+    cout << "Usage: ./sst-search-bench <lookups> <max_shift>" << endl;
+    return 0;
+  }
+  const u64 lookups = atoll(argv[1]);
+  const int max_shift = atoi(argv[2]);
+  std::mt19937_64 gen(42);
+  cout << "keys\tkEntrys(ns)\tsorted(ns)\tEytzinger(ns)" << endl;
+  for (int shift = 8; shift <= max_shift; shift += 2) {
+    u64 n = 1ULL << shift;
+    // HINT: even keys only, half of the lookups miss
+    kEntrys kes;
+    kes.reserve(n);
+    for (u64 i = 0; i < n; ++i) {
+      kes.push_back({2 * i, i, 1});
+    }
+    KeyIndex sorted(kes, -1);
+    KeyIndex eytzinger(kes, 0);
+    std::vector<TKey> keys(lookups);
+    for (auto &key : keys) {
+      key = gen() % (2 * n);
+    }
+    u64 old_sum = 0;
+    u64 sorted_sum = 0;
+    u64 eytzinger_sum = 0;
+    double old_ns = timeIt(
+        keys,
+        [&kes, n](TKey key) {
+          bool found = false;
+          return binary_search_helper(key, 0, n - 1, kes, found);
+        },
+        old_sum);
+    double sorted_ns = timeIt(
+        keys, [&sorted](TKey key) { return sorted.find(key); }, sorted_sum);
+    double eytzinger_ns = timeIt(
+        keys, [&eytzinger](TKey key) { return eytzinger.find(key); },
+        eytzinger_sum);
+    if (old_sum != sorted_sum || old_sum != eytzinger_sum) {
+      cout << "mismatch at " << n << " keys" << endl;
+      return 1;
+    }
+    cout << n << "\t" << old_ns << "\t" << sorted_ns << "\t" << eytzinger_ns
+         << endl;
+  }
+  return 0;
+}
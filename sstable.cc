@@ -2,15 +2,35 @@
 #include "bloomfilter.h"
 #include "type.h"
 #include "utils.h"
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
 namespace SSTable {
-u64 sstable_type::ss_total_uid = 1; // the first timestamp is 1
+std::atomic<u64> sstable_type::ss_total_uid = 1; // the first timestamp is 1
 void sstable_type::resetID() { ss_total_uid = 1; }
+static void encodeBlock(const kEntry *kes, u64 count, TBytes &bytes);
+/**
+@brief report a failed read of a loaded SSTable
+ * @throw std::runtime_error always, a lookup must not take a corrupt block for
+ * a missing key (and fall through to an older value)
+ */
+[[noreturn]] static void readFailed(const std::string &what) {
+    std::string msg = "Corrupted sstable: " + what;
+    std::cerr << msg << std::endl;
+    throw std::runtime_error(msg);
+}
+BlockCache &sstable_type::blockCache() {
+    static BlockCache cache(config::block_cache_size);
+    return cache;
+}
 sstable_type::sstable_type(u64 BF_size, int hash_num)
     : ss_uid(ss_total_uid), bf_size(BF_size), hash_func_num(hash_num),
       BF(BF_size, hash_num), header({ss_total_uid, 0, 0, 0}) {
@@ -42,6 +62,7 @@ sstable_type::sstable_type(const kEntrys &kes, u64 timeStamp, u64 BF_size,
     header.setMaxKey(maxKey);
     header.setNumOfKV(num_of_kv);
     header.setTimeStamp(timeStamp);
+    buildIndex();
 }
 sstable_type::sstable_type(kEntrys &&kes, u64 timeStamp, u64 BF_size,
                            int hash_num)
@@ -67,6 +88,7 @@ sstable_type::sstable_type(kEntrys &&kes, u64 timeStamp, u64 BF_size,
     header.setMinKey(minKey);
     header.setMaxKey(maxKey);
     header.setNumOfKV(num_of_kv);
+    buildIndex();
 }
 sstable_type::sstable_type(const sstable_type &other) = default;
 void sstable_type::addBF(const kEntrys &kes) {
@@ -75,7 +97,9 @@ void sstable_type::addBF(const kEntrys &kes) {
         std::cerr << msg << std::endl;
         throw std::runtime_error(msg);
     }
-    for (const auto &entry : *pkes) {
+    // HINT: hold the kEntrys, a lazy SSTable returns a temporary copy
+    auto entries = getKEntrys();
+    for (const auto &entry : *entries) {
         BF.insert_u64(entry.key);
     }
 }
@@ -89,6 +113,11 @@ u64 sstable_type::size() const {
 }
 void sstable_type::clear() {
     pkes = std::make_unique<kEntrys>();
+    buildIndex();
+    pfd.reset();
+    pmap.reset();
+    fences.clear();
+    blocks.clear();
     header.clear();
     if (config::use_bf) {
         BF.clear();
@@ -102,7 +131,10 @@ void sstable_type::clear() {
  * @return u64
  */
 u64 sstable_type::cal_size(size_t number_of_kv, u64 BF_size) {
-    return number_of_kv * sizeof(kEntry) + sizeof(header) + BF_size / 8;
+    u64 block_entries = std::max<u64>(config::fence_interval, 1);
+    u64 block_num = (number_of_kv + block_entries - 1) / block_entries;
+    return number_of_kv * sizeof(kEntry) + sizeof(header) + BF_size / 8 +
+           block_num * sizeof(BlockHandle) + sizeof(Footer);
 }
 
 /**
@@ -120,39 +152,28 @@ bool sstable_type::mayKeyExist(TKey key) const {
     }
     return true;
 }
-u64 binary_search_helper(TKey key, u64 left, u64 right, const kEntrys &kes,
-                         bool &found) {
-    if (left == right) {
-        found = kes[left].key == key;
-        return found ? left : -1;
-    }
-    u64 mid = (left + right) / 2;
-    if (kes[mid].key == key) {
-        found = true;
-        return mid;
-    }
-    if (kes[mid].key > key) {
-        return binary_search_helper(key, left, mid, kes, found);
-    }
-    return binary_search_helper(key, mid + 1, right, kes, found);
-}
 /**
-@brief binary search in sstable in range [0, total)
+@brief search the key in the in-memory kEntrys
  * @param  key
- * @param  total total number of kv
  * @param  exist true if found, false if not found
  * @param  use_BF
  * @return u64 index if found, -1 if not found
  */
-u64 sstable_type::binary_search(TKey key, u64 total, bool &exist,
-                                bool use_BF) const {
-    // NOTE: idx form 0 to total - 1
-    if (use_BF && !BF.find_u64(key)) {
+u64 sstable_type::binary_search(TKey key, bool &exist, bool use_BF) const {
+    if ((use_BF && !BF.find_u64(key)) || pindex == nullptr) {
         exist = false;
         return -1;
     }
-    exist = false;
-    return binary_search_helper(key, 0, total - 1, *pkes, exist);
+    auto idx = pindex->find(key);
+    exist = idx != KeyIndex::npos;
+    return idx;
+}
+/**
+@brief rebuild the key index of pkes (none in lazy mode)
+ */
+void sstable_type::buildIndex() {
+    pindex =
+        pkes == nullptr ? nullptr : std::make_shared<const KeyIndex>(*pkes);
 }
 
 /**
@@ -172,14 +193,26 @@ kEntry sstable_type::query(TKey key) const {
     //     return entry;
     //   }
     // }
+    if (isLazy()) {
+        // HINT: the key can only be in the block of the last fence <= key
+        auto fence = std::upper_bound(fences.begin(), fences.end(), key);
+        if (fence == fences.begin()) {
+            return type::ke_not_found;
+        }
+        auto bytes = readBlock(fence - fences.begin() - 1);
+        kEntry ke;
+        if (!seekBlock(bytes->data(), bytes->size(), key, ke)) {
+            return type::ke_not_found;
+        }
+        return ke;
+    }
     bool exist = false;
-    auto total = header.getNumOfKV();
-    auto choose = binary_search(key, total, exist, false);
+    auto choose = binary_search(key, exist, false);
     if (!exist) {
         return type::ke_not_found;
     }
 
-    Log("The total number of kv is %d", total);
+    Log("The total number of kv is %d", header.getNumOfKV());
     Log("The real key is %llu", key);
 
     if (pkes->at(choose).key != key) {
@@ -190,6 +223,59 @@ kEntry sstable_type::query(TKey key) const {
     return pkes->at(choose);
 }
 /**
+@brief look up many keys in one merged pass over the kEntrys
+ * @param  keys sorted ascending
+ * @param  res res[i] is set to the kEntry of keys[i] if found here
+ * @param  found found[i] marks keys[i] resolved, the resolved ones (by a newer
+ * SSTable) are skipped and the ones found here are marked
+ * @return size_t the number of keys found here
+ */
+size_t sstable_type::queryBatch(const std::vector<TKey> &keys,
+                                std::vector<kEntry> &res,
+                                std::vector<char> &found) const {
+    auto first = std::lower_bound(keys.begin(), keys.end(),
+                                  header.getMinKey()) -
+                 keys.begin();
+    auto last = std::upper_bound(keys.begin(), keys.end(),
+                                 header.getMaxKey()) -
+                keys.begin();
+    auto less = [](const kEntry &ke, TKey key) { return ke.key < key; };
+    size_t hit = 0;
+    // NOTE: keys only move forward, so does the cursor in the kEntrys (and
+    // every block of a lazy SSTable is read at most once)
+    kEntrys decoded;
+    const kEntrys *kes = isLazy() ? &decoded : pkes.get();
+    u64 cur_block = -1;
+    size_t cursor = 0;
+    for (auto i = first; i < last; ++i) {
+        TKey key = keys[i];
+        if (found[i] || (config::use_bf && !BF.find_u64(key))) {
+            continue;
+        }
+        if (isLazy()) {
+            auto fence = std::upper_bound(fences.begin(), fences.end(), key);
+            if (fence == fences.begin()) {
+                continue;
+            }
+            u64 block = fence - fences.begin() - 1;
+            if (block != cur_block) {
+                decoded.clear();
+                readBlockKEntrys(block, decoded);
+                cur_block = block;
+                cursor = 0;
+            }
+        }
+        auto it = std::lower_bound(kes->begin() + cursor, kes->end(), key, less);
+        cursor = it - kes->begin();
+        if (it != kes->end() && it->key == key) {
+            res[i] = *it;
+            found[i] = 1;
+            ++hit;
+        }
+    }
+    return hit;
+}
+/**
 @brief scan the sstable
  * @param  min minKey
  * @param  max maxKey
@@ -205,6 +291,27 @@ void sstable_type::scan(TKey min, TKey max, kEntrys &res) const {
     if (max > header.getMaxKey()) {
         max = header.getMaxKey();
     }
+    if (isLazy()) {
+        // NOTE: read the blocks from the last fence <= min to the first
+        // fence > max
+        auto first = std::upper_bound(fences.begin(), fences.end(), min);
+        auto last = std::upper_bound(first, fences.end(), max);
+        // HINT: a range read, let the kernel read the blocks ahead
+        adviseBlocks(first - fences.begin() - 1, last - fences.begin(),
+                     MADV_WILLNEED);
+        kEntrys decoded;
+        for (u64 block = first - fences.begin() - 1;
+             block < static_cast<u64>(last - fences.begin()); ++block) {
+            decoded.clear();
+            readBlockKEntrys(block, decoded);
+            for (const auto &entry : decoded) {
+                if (entry.key >= min && entry.key <= max) {
+                    res.push_back(entry);
+                }
+            }
+        }
+        return;
+    }
     for (const auto &entry : *pkes) {
         if (entry.key >= min && entry.key <= max) {
             res.push_back(entry);
@@ -221,18 +328,46 @@ void sstable_type::save(const std::string &path) {
         Log(msg, path.c_str());
     }
     std::ofstream ofile(path, std::ios::binary | std::ios::trunc);
-    // | Header | BF | kEntrys |
+    // | Header | BF | blocks | block index | Footer |
     ofile.write(reinterpret_cast<char *>(&header), sizeof(header));
     if (config::use_bf) {
         auto bytes = BF.toBytes();
         ofile.write(reinterpret_cast<char *>(bytes.data()), bytes.size());
     }
-
-    for (auto &entry : *pkes) {
-        ofile.write(reinterpret_cast<char *>(&entry), sizeof(entry));
+    kes_offset = sizeof(header) + (config::use_bf ? bf_size / 8 : 0);
+    fence_interval = std::max<u64>(config::fence_interval, 1);
+    blocks.clear();
+    version = format_version;
+    auto kes = getKEntrys();
+    u64 offset = kes_offset;
+    TBytes bytes;
+    for (u64 begin = 0; begin < kes->size(); begin += fence_interval) {
+        u64 count = std::min<u64>(fence_interval, kes->size() - begin);
+        encodeBlock(kes->data() + begin, count, bytes);
+        u32 size = bytes.size();
+        ofile.write(reinterpret_cast<char *>(bytes.data()), size);
+        blocks.push_back({.first_key = kes->at(begin).key,
+                          .offset = offset,
+                          .size = size,
+                          .crc = utils::crc32(bytes.data(), size)});
+        offset += size;
     }
+    Footer footer{.index_offset = offset,
+                  .block_num = static_cast<u32>(blocks.size()),
+                  .block_entries = static_cast<u32>(fence_interval),
+                  .index_crc = utils::crc32(
+                      blocks.data(), blocks.size() * sizeof(BlockHandle)),
+                  .version = format_version,
+                  .magic = footer_magic};
+    ofile.write(reinterpret_cast<char *>(blocks.data()),
+                blocks.size() * sizeof(BlockHandle));
+    ofile.write(reinterpret_cast<char *>(&footer), sizeof(footer));
     ofile.flush(); // ATTENTION: 立即刷盘
     ofile.close();
+    if (config::sync_mode != config::SyncMode::none) {
+        // HINT: flush only hands the bytes to the page cache
+        utils::syncFile(path);
+    }
 }
 
 void sstable_type::load(const std::string &path) {
@@ -249,15 +384,483 @@ void sstable_type::load(const std::string &path) {
         this->BF = BloomFilter(bytes);
         assert(BF.default_hash_gen_seed == BF.getSeed());
     }
+    kes_offset = sizeof(header) + (config::use_bf ? bf_size / 8 : 0);
+    blocks.clear();
+    // NOTE: the footer decides, a block file may have the size of a v1 one.
+    // A v1 file has no footer and is exactly | Header | BF | kEntrys |
+    u64 file_size = std::filesystem::file_size(path);
+    if (!readIndex(ifile, file_size)) {
+        if (file_size != kes_offset + header.getNumOfKV() * sizeof(kEntry))
+            [[unlikely]] {
+            std::string msg = "Bad sstable(" + path + "): no footer";
+            std::cerr << msg << std::endl;
+            throw std::runtime_error(msg);
+        }
+        ifile.clear();
+        ifile.seekg(kes_offset);
+        version = 1;
+    }
+    if (lazyMode()) {
+        ifile.close();
+        pkes = nullptr;
+        pindex = nullptr;
+        openLazy(path);
+        return;
+    }
 
-    std::list<kEntry> kes;
-    for (int i = 0; i < header.getNumOfKV(); ++i) {
-        kEntry entry;
-        ifile.read(reinterpret_cast<char *>(&entry), sizeof(entry));
-        kes.push_back(entry);
-    }
-    pkes = std::make_shared<kEntrys>(std::make_move_iterator(kes.begin()),
-                                     std::make_move_iterator(kes.end()));
+    if (!blocks.empty()) {
+        auto kes = std::make_shared<kEntrys>();
+        kes->reserve(header.getNumOfKV());
+        TBytes bytes;
+        for (const auto &handle : blocks) {
+            bytes.resize(handle.size);
+            ifile.seekg(handle.offset);
+            ifile.read(reinterpret_cast<char *>(bytes.data()), handle.size);
+            if (!ifile ||
+                utils::crc32(bytes.data(), handle.size) != handle.crc ||
+                !decodeBlock(bytes.data(), handle.size, *kes)) [[unlikely]] {
+                std::string msg = "Corrupted block in sstable(" + path + ")";
+                std::cerr << msg << std::endl;
+                throw std::runtime_error(msg);
+            }
+        }
+        pkes = std::move(kes);
+        buildIndex();
+        ifile.close();
+        return;
+    }
+    // HINT: a v1 file, the kEntrys in one read
+    auto kes = std::make_shared<kEntrys>(header.getNumOfKV());
+    ifile.read(reinterpret_cast<char *>(kes->data()),
+               kes->size() * sizeof(kEntry));
+    pkes = std::move(kes);
+    buildIndex();
     ifile.close();
 }
+/**
+@brief read and check the Footer and the block index of a v2/v3 file
+ * @return bool false if the file ends with no footer magic (a v1 file)
+ * @throw std::runtime_error if the footer or the block index is bad (e.g.
+torn by a crash)
+ */
+bool sstable_type::readIndex(std::ifstream &ifile, u64 file_size) {
+    Footer footer{};
+    if (file_size >= kes_offset + sizeof(footer)) {
+        ifile.seekg(file_size - sizeof(footer));
+        ifile.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    }
+    if (!ifile || footer.magic != footer_magic) {
+        return false;
+    }
+    u64 index_size = static_cast<u64>(footer.block_num) * sizeof(BlockHandle);
+    if (footer.version < 2 || footer.version > format_version ||
+        footer.block_entries == 0 ||
+        footer.index_offset + index_size + sizeof(footer) != file_size)
+        [[unlikely]] {
+        std::string msg = "Bad sstable footer";
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+    blocks.resize(footer.block_num);
+    ifile.seekg(footer.index_offset);
+    ifile.read(reinterpret_cast<char *>(blocks.data()), index_size);
+    if (!ifile || utils::crc32(blocks.data(), index_size) != footer.index_crc)
+        [[unlikely]] {
+        blocks.clear();
+        std::string msg = "Corrupted sstable block index";
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+    fence_interval = footer.block_entries;
+    version = footer.version;
+    return true;
+}
+/**
+@brief switch a saved SSTable to lazy mode, the kEntrys in memory are dropped
+ * @param  path the file the SSTable is saved to
+ */
+void sstable_type::dropKEntrys(const std::string &path) {
+    openLazy(path);
+    pkes = nullptr;
+    pindex = nullptr;
+}
+/**
+@brief open the file and build the fence index (from the block index of a v2
+file, from pkes if it is still in memory, else by reading every
+fence_interval-th kEntry)
+ * @param  path
+ */
+void sstable_type::openLazy(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) [[unlikely]] {
+        std::string msg = "Try to open file(" + path + ") failed";
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) [[unlikely]] {
+        ::close(fd);
+        std::string msg = "Try to stat file(" + path + ") failed";
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
+    }
+    file_id = BlockKey{};
+    file_id.dev = st.st_dev;
+    file_id.ino = st.st_ino;
+    file_id.mtime = static_cast<u64>(st.st_mtim.tv_sec) * 1000000000ULL +
+                    st.st_mtim.tv_nsec;
+    file_id.size = st.st_size;
+    file_id.stamp = header.getTimeStamp();
+    if (!blocks.empty()) {
+        file_id.crc = utils::crc32(blocks.data(),
+                                   blocks.size() * sizeof(BlockHandle));
+    }
+    if (config::mmap_sst) {
+        // NOTE: the mapping outlives the descriptor (and an unlink of the
+        // file by compaction)
+        map_size = std::filesystem::file_size(path);
+        void *addr = ::mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) [[unlikely]] {
+            std::string msg = "Try to mmap file(" + path + ") failed";
+            std::cerr << msg << std::endl;
+            throw std::runtime_error(msg);
+        }
+        // HINT: point lookups touch one block, no readahead around it
+        ::madvise(addr, map_size, MADV_RANDOM);
+        u64 size = map_size;
+        pmap = std::shared_ptr<const u8>(
+            static_cast<const u8 *>(addr),
+            [size](const u8 *p) { ::munmap(const_cast<u8 *>(p), size); });
+        pfd.reset();
+    } else {
+        pfd = std::shared_ptr<int>(new int(fd), [](const int *pfd) {
+            ::close(*pfd);
+            delete pfd;
+        });
+        pmap.reset();
+    }
+    kes_offset = sizeof(header) + (config::use_bf ? bf_size / 8 : 0);
+    fences.clear();
+    if (!blocks.empty()) {
+        // HINT: fence_interval is the block_entries of the file
+        for (const auto &handle : blocks) {
+            fences.push_back(handle.first_key);
+        }
+        return;
+    }
+    fence_interval = std::max<u64>(config::fence_interval, 1);
+    auto total = header.getNumOfKV();
+    for (u64 i = 0; i < total; i += fence_interval) {
+        if (pkes != nullptr) {
+            fences.push_back(pkes->at(i).key);
+            continue;
+        }
+        kEntry entry{};
+        if (!readAt(kes_offset + i * sizeof(entry), &entry, sizeof(entry)))
+            [[unlikely]] {
+            readFailed("fence " + std::to_string(i) + " unreadable");
+        }
+        fences.push_back(entry.key);
+    }
+}
+/**
+@brief get the bytes of a block through the block cache (lazy mode)
+ * @param  block the number of the fence the block starts at
+ */
+std::shared_ptr<const TBytes> sstable_type::readBlock(u64 block) const {
+    BlockKey key = file_id;
+    key.interval = fence_interval;
+    key.block = block;
+    auto &cache = blockCache();
+    if (auto bytes = cache.lookup(key)) {
+        return bytes;
+    }
+    auto bytes = std::make_shared<TBytes>();
+    u32 size;
+    const u8 *data = blockData(block, *bytes, size);
+    if (data != bytes->data()) {
+        bytes->assign(data, data + size);
+    }
+    cache.insert(key, bytes, bytes->size());
+    return bytes;
+}
+/**
+@brief get the kEntrys of a block through the block cache and append them
+(lazy mode)
+ * @throw std::runtime_error if the block is malformed
+ */
+void sstable_type::readBlockKEntrys(u64 block, kEntrys &res) const {
+    auto bytes = readBlock(block);
+    if (!decodeBlock(bytes->data(), bytes->size(), res)) [[unlikely]] {
+        readFailed("block " + std::to_string(block) + " undecodable");
+    }
+}
+/**
+@brief read a block from the file and append its kEntrys (lazy mode), the
+block cache is left alone
+ * @throw std::runtime_error if the read failed or the block is corrupted
+ */
+void sstable_type::readBlockFile(u64 block, kEntrys &res) const {
+    thread_local TBytes buf;
+    u32 size;
+    const u8 *data = blockData(block, buf, size);
+    if (!decodeBlock(data, size, res)) [[unlikely]] {
+        readFailed("block " + std::to_string(block) + " undecodable");
+    }
+}
+/**
+@brief the bytes of a block (lazy mode), in place in the mapping of an mmap
+file, else read into buf. A v2/v3 block is checked against its crc, a v1
+block is the raw kEntrys between two fences
+ * @param  size set to the size of the block
+ * @throw std::runtime_error if the read failed or the block is corrupted
+ */
+const u8 *sstable_type::blockData(u64 block, TBytes &buf, u32 &size) const {
+    u64 offset;
+    if (blocks.empty()) {
+        u64 begin = block * fence_interval;
+        u64 end = std::min((block + 1) * fence_interval, header.getNumOfKV());
+        offset = kes_offset + begin * sizeof(kEntry);
+        size = (end - begin) * sizeof(kEntry);
+    } else {
+        offset = blocks.at(block).offset;
+        size = blocks.at(block).size;
+    }
+    const u8 *data;
+    if (pmap != nullptr) {
+        if (offset + size > map_size) [[unlikely]] {
+            readFailed("block " + std::to_string(block) + " out of the file");
+        }
+        data = pmap.get() + offset;
+    } else {
+        buf.resize(size);
+        if (!readAt(offset, buf.data(), size)) [[unlikely]] {
+            readFailed("block " + std::to_string(block) + " unreadable");
+        }
+        data = buf.data();
+    }
+    if (!blocks.empty() && utils::crc32(data, size) != blocks[block].crc)
+        [[unlikely]] {
+        readFailed("block " + std::to_string(block) + " crc mismatch");
+    }
+    return data;
+}
+/**
+@brief read len bytes at offset of the file (lazy mode)
+ * @return false if the read failed
+ */
+bool sstable_type::readAt(u64 offset, void *dst, u64 len) const {
+    if (pmap != nullptr) {
+        if (offset + len > map_size) [[unlikely]] {
+            Log("read sstable failed at %lld", offset);
+            return false;
+        }
+        std::memcpy(dst, pmap.get() + offset, len);
+        return true;
+    }
+    auto *buf = static_cast<char *>(dst);
+    while (len > 0) {
+        ssize_t n = ::pread(*pfd, buf, len, offset);
+        if (n <= 0) [[unlikely]] {
+            Log("read sstable failed at %lld", offset);
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+/**
+@brief madvise the bytes of the blocks [first, last) of a mapped file
+ */
+void sstable_type::adviseBlocks(u64 first, u64 last, int advice) const {
+    if (pmap == nullptr || first >= last) {
+        return;
+    }
+    u64 begin;
+    u64 end;
+    if (blocks.empty()) {
+        begin = kes_offset + first * fence_interval * sizeof(kEntry);
+        end = kes_offset + std::min(last * fence_interval,
+                                    header.getNumOfKV()) *
+                               sizeof(kEntry);
+    } else {
+        begin = blocks.at(first).offset;
+        end = blocks.at(last - 1).offset + blocks.at(last - 1).size;
+    }
+    // HINT: madvise wants a page aligned start
+    static const u64 page = ::sysconf(_SC_PAGESIZE);
+    begin = begin / page * page;
+    ::madvise(const_cast<u8 *>(pmap.get()) + begin, end - begin, advice);
+}
+/**
+@brief encode the kEntrys of a block (v3)
+ * @param  kes sorted by key
+ * @param  bytes the encoded block
+ */
+static void encodeBlock(const kEntry *kes, u64 count, TBytes &bytes) {
+    bytes.clear();
+    std::vector<u32> restarts;
+    TKey last = 0;
+    for (u64 i = 0; i < count; ++i) {
+        if (i % restart_interval == 0) {
+            restarts.push_back(bytes.size());
+            last = 0;
+        }
+        utils::putVarint64(bytes, kes[i].key - last);
+        utils::putVarint64(bytes, kes[i].offset);
+        utils::putVarint64(bytes, kes[i].len);
+        last = kes[i].key;
+    }
+    restarts.push_back(restarts.size());
+    auto old_size = bytes.size();
+    bytes.resize(old_size + restarts.size() * sizeof(u32));
+    std::memcpy(bytes.data() + old_size, restarts.data(),
+                restarts.size() * sizeof(u32));
+}
+/**
+@brief decode a block and append its kEntrys
+ * @return false if the block is malformed, nothing is appended then
+ */
+bool sstable_type::decodeBlock(const u8 *data, u32 size, kEntrys &res) const {
+    if (version <= 2) {
+        if (size % sizeof(kEntry) != 0) {
+            return false;
+        }
+        auto count = size / sizeof(kEntry);
+        res.resize(res.size() + count);
+        std::memcpy(res.data() + res.size() - count, data,
+                    count * sizeof(kEntry));
+        return true;
+    }
+    u32 restart_num;
+    if (size < sizeof(restart_num)) {
+        return false;
+    }
+    std::memcpy(&restart_num, data + size - sizeof(restart_num),
+                sizeof(restart_num));
+    u64 trailer = (static_cast<u64>(restart_num) + 1) * sizeof(u32);
+    if (trailer > size) {
+        return false;
+    }
+    const u8 *p = data;
+    const u8 *end = data + size - trailer;
+    auto old_size = res.size();
+    u64 i = 0;
+    TKey last = 0;
+    while (p != nullptr && p < end) {
+        u64 key = 0;
+        u64 offset = 0;
+        u64 len = 0;
+        p = utils::getVarint64(p, end, key);
+        p = p == nullptr ? p : utils::getVarint64(p, end, offset);
+        p = p == nullptr ? p : utils::getVarint64(p, end, len);
+        if (i % restart_interval != 0) {
+            key += last;
+        }
+        res.push_back({.key = key,
+                       .offset = offset,
+                       .len = static_cast<TLen>(len)});
+        last = key;
+        ++i;
+    }
+    if (p == nullptr ||
+        (i + restart_interval - 1) / restart_interval != restart_num) {
+        res.resize(old_size);
+        return false;
+    }
+    return true;
+}
+/**
+@brief find a key in a block without decoding all of it. A v3 block is
+binary searched by its restart points (their keys are stored whole) and
+decoded from the last one <= key, at most restart_interval entries
+ * @param  res set to the kEntry of the key if found
+ * @return bool false if the block has no such key
+ * @throw std::runtime_error if the block is malformed
+ */
+bool sstable_type::seekBlock(const u8 *data, u32 size, TKey key,
+                             kEntry &res) const {
+    if (version <= 2) {
+        // HINT: raw kEntrys, maybe unaligned in a mapping
+        u64 lo = 0;
+        u64 hi = size / sizeof(kEntry);
+        while (lo < hi) {
+            u64 mid = (lo + hi) / 2;
+            TKey mid_key;
+            std::memcpy(&mid_key, data + mid * sizeof(kEntry),
+                        sizeof(mid_key));
+            if (mid_key < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == size / sizeof(kEntry)) {
+            return false;
+        }
+        std::memcpy(&res, data + lo * sizeof(kEntry), sizeof(res));
+        return res.key == key;
+    }
+    u32 restart_num;
+    if (size < sizeof(restart_num)) [[unlikely]] {
+        readFailed("block too short");
+    }
+    std::memcpy(&restart_num, data + size - sizeof(restart_num),
+                sizeof(restart_num));
+    u64 trailer = (static_cast<u64>(restart_num) + 1) * sizeof(u32);
+    if (trailer > size) [[unlikely]] {
+        readFailed("bad restart num");
+    }
+    const u8 *end = data + size - trailer;
+    auto restart = [data, end](u32 i) {
+        u32 offset;
+        std::memcpy(&offset, end + i * sizeof(u32), sizeof(offset));
+        if (offset >= static_cast<u64>(end - data)) [[unlikely]] {
+            readFailed("bad restart offset");
+        }
+        return data + offset;
+    };
+    // NOTE: the first restart point with a key > key
+    u32 lo = 0;
+    u32 hi = restart_num;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        u64 mid_key = 0;
+        if (utils::getVarint64(restart(mid), end, mid_key) == nullptr)
+            [[unlikely]] {
+            readFailed("bad restart entry");
+        }
+        if (mid_key <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return false;
+    }
+    const u8 *p = restart(lo - 1);
+    TKey last = 0;
+    for (u32 i = 0; i < restart_interval && p < end; ++i) {
+        u64 cur = 0;
+        u64 offset = 0;
+        u64 len = 0;
+        p = utils::getVarint64(p, end, cur);
+        p = p == nullptr ? p : utils::getVarint64(p, end, offset);
+        p = p == nullptr ? p : utils::getVarint64(p, end, len);
+        if (p == nullptr) [[unlikely]] {
+            readFailed("bad block entry");
+        }
+        cur += last;
+        if (cur >= key) {
+            res = {.key = cur, .offset = offset, .len = static_cast<TLen>(len)};
+            return cur == key;
+        }
+        last = cur;
+    }
+    return false;
+}
 } // namespace SSTable
@@ -2,9 +2,15 @@
 #ifndef __SSTABLE_H
 #define __SSTABLE_H
 #include "bloomfilter.h"
+#include "cache.h"
 #include "config.h"
+#include "keyindex.h"
 #include "type.h"
+#include <atomic>
+#include <fstream>
 #include <memory>
+#include <sys/mman.h>
+#include <vector>
 namespace SSTable {
 
 class Header {
@@ -53,19 +59,109 @@ class Header {
     }
 };
 
+// NOTE: a block of a lazy SSTable is the kEntrys between two fences. It is
+// keyed by the file it comes from, not by the open of it, so the SSTables
+// loaded again on every get in no-cache mode share the cached blocks.
+// An SSTable is never rewritten in place. A new file on a reused inode
+// differs in mtime, size, timestamp or the crc of its block index (which
+// covers the crc of every block), the mtime alone may be a coarse tick;
+// the fence interval is in the key as a v1 file has no block index, its
+// blocks are cut by the config at open time
+struct BlockKey {
+    u64 dev = 0;
+    u64 ino = 0;
+    u64 mtime = 0; // ns
+    u64 size = 0;
+    u64 stamp = 0; // the timestamp of the SSTable
+    u64 crc = 0;   // of the block index, 0 for a v1 file
+    u64 interval = 0;
+    u64 block = 0;
+    bool operator==(const BlockKey &) const = default;
+};
+struct BlockKeyHash {
+    size_t operator()(const BlockKey &k) const {
+        u64 h = k.dev;
+        for (u64 v :
+             {k.ino, k.mtime, k.size, k.stamp, k.crc, k.interval, k.block}) {
+            h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+        }
+        return std::hash<u64>()(h);
+    }
+};
+// NOTE: a block is cached as its bytes in the file, checked against its crc
+// once when read. A point lookup searches them in place (by the restart
+// points of a v3 block), a scan decodes them
+using BlockCache = ShardedLRUCache<BlockKey, TBytes, BlockKeyHash>;
+// NOTE: on-disk format v3: | Header | BF | blocks | block index | Footer |.
+// A block holds block_entries kEntrys (the last one may hold less), the index
+// has a BlockHandle per block and the fixed-size Footer ends the file. A v1
+// file (| Header | BF | kEntrys |, told apart by the missing footer) is
+// still read
+// NOTE: a v3 block is | entries | restart offsets (u32) | restart num (u32) |,
+// an entry is the varints key, offset and len, where the key is the delta
+// from the previous one except on every restart_interval-th entry (a restart
+// point). A v2 block is the raw kEntrys
+struct BlockHandle {
+    TKey first_key;
+    u64 offset; // in the file
+    u32 size;   // bytes
+    u32 crc;    // crc32 of the block bytes
+};
+struct Footer {
+    u64 index_offset;
+    u32 block_num;
+    u32 block_entries;
+    u32 index_crc; // crc32 of the block index
+    u32 version;
+    u64 magic;
+};
+constexpr u32 format_version = 3;
+constexpr u32 restart_interval = 16;
+constexpr u64 footer_magic = 0x5453534b564d534cULL; // "LSMKVSST"
+
 class sstable_type {
     // NOTE: the sstable_type in mem act as cache for the sstable on disk
   private:
     u64 ss_uid;
     u64 bf_size;
     int hash_func_num;
-    static u64 ss_total_uid;
+    static std::atomic<u64> ss_total_uid;
 
     BloomFilter BF;
     Header header;
     std::shared_ptr<kEntrys> pkes;
-    u64 binary_search(TKey key, u64 total, bool &exist,
-                      bool use_BF = true) const;
+    // NOTE: the keys of pkes for query, rebuilt whenever pkes is replaced
+    std::shared_ptr<const KeyIndex> pindex;
+    // NOTE: lazy mode (config::lazy_load), pkes is nullptr and the kEntrys
+    // are read from the file on demand. Only the header, the BF and the key
+    // of every fence_interval-th kEntry stay in memory. The file is kept
+    // open, so it can still be read after compaction unlinks it
+    std::shared_ptr<int> pfd;
+    // NOTE: config::mmap_sst, the read-only mapping of the whole file takes
+    // the place of pfd
+    std::shared_ptr<const u8> pmap;
+    u64 map_size = 0;
+    u64 kes_offset = 0; // where the kEntrys begin in the file
+    u64 fence_interval = 0;
+    std::vector<TKey> fences;
+    // NOTE: the block index of a v2/v3 file, empty for a v1 one
+    std::vector<BlockHandle> blocks;
+    u32 version = format_version;
+    // NOTE: the identity of the opened file, block is 0 here. Keys its
+    // blocks in the block cache
+    BlockKey file_id;
+    u64 binary_search(TKey key, bool &exist, bool use_BF = true) const;
+    void buildIndex();
+    void openLazy(const std::string &path);
+    bool readAt(u64 offset, void *dst, u64 len) const;
+    void adviseBlocks(u64 first, u64 last, int advice) const;
+    const u8 *blockData(u64 block, TBytes &buf, u32 &size) const;
+    void readBlockFile(u64 block, kEntrys &res) const;
+    void readBlockKEntrys(u64 block, kEntrys &res) const;
+    bool decodeBlock(const u8 *data, u32 size, kEntrys &res) const;
+    bool seekBlock(const u8 *data, u32 size, TKey key, kEntry &res) const;
+    std::shared_ptr<const TBytes> readBlock(u64 block) const;
+    bool readIndex(std::ifstream &ifile, u64 file_size);
 
   public:
     static u64 getCurID() { return ss_total_uid; }
@@ -98,10 +194,22 @@ class sstable_type {
                         u64 BF_size = config::bf_default_size);
     void save(const std::string &path);
     void load(const std::string &path);
+    void dropKEntrys(const std::string &path);
+    [[nodiscard]] bool isLazy() const {
+        return pfd != nullptr || pmap != nullptr;
+    }
+    [[nodiscard]] static bool lazyMode() {
+        return config::lazy_load || config::mmap_sst;
+    }
+    // NOTE: the key blocks of the lazy SSTables, config::block_cache_size
+    // bytes shared by all of them
+    static BlockCache &blockCache();
     [[nodiscard]] bool mayKeyExist(TKey key) const;
     // [[nodiscard]] bool mayKeyExist(TKey key, std::string ss_file) const;
     void scan(TKey min, TKey max, kEntrys &res) const;
     [[nodiscard]] kEntry query(TKey key) const;
+    size_t queryBatch(const std::vector<TKey> &keys, std::vector<kEntry> &res,
+                      std::vector<char> &found) const;
     // [[nodiscard]] kEntry query(TKey key, std::string ss_file) const;
     void clear();
     BloomFilter getBF() const {
@@ -114,11 +222,19 @@ class sstable_type {
     [[nodiscard]] std::shared_ptr<kEntrys> getKEntrys() const {
         // HINT: no cache is just no-cache in kvstore, loaded sstable can do
         // operations
+        if (isLazy()) {
+            auto kes = std::make_shared<kEntrys>();
+            adviseBlocks(0, fences.size(), MADV_SEQUENTIAL);
+            for (u64 block = 0; block < fences.size(); ++block) {
+                readBlockFile(block, *kes);
+            }
+            return kes;
+        }
         return this->pkes;
     }
     ~sstable_type() = default;
     [[nodiscard]] u64 getUID() const { return ss_uid; }
-    [[nodiscard]] u64 getKEntryNum() const { return pkes->size(); }
+    [[nodiscard]] u64 getKEntryNum() const { return header.getNumOfKV(); }
     [[nodiscard]] Header getHeader() const { return header; }
 
     [[nodiscard]] std::string gen_filename() const {
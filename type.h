@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <filesystem>
 #include <list>
+#include <cstring>
 #include <string>
 #include <vector>
 using u64 = uint64_t;
@@ -36,6 +37,20 @@ using kEntry = struct kEntry {
     return key != rhs.key || offset != rhs.offset || len != rhs.len;
   }
   [[nodiscard]] bool is_deleted() const { return len == 0; }
+  // NOTE: an inlined value (config::inline_value_size bytes at most) is kept
+  // in the offset field instead of the vlog, the top bit of len flags it
+  static constexpr TLen inline_flag = 1U << 31;
+  [[nodiscard]] bool is_inline() const { return (len & inline_flag) != 0; }
+  [[nodiscard]] std::string inline_value() const {
+    return {reinterpret_cast<const char *>(&offset), len & ~inline_flag};
+  }
+  static kEntry make_inline(TKey key, const std::string &value) {
+    kEntry ke{.key = key,
+              .offset = 0,
+              .len = static_cast<TLen>(value.size()) | inline_flag};
+    std::memcpy(&ke.offset, value.data(), value.size());
+    return ke;
+  }
 };
 using kEntrys = std::vector<kEntry>;
 using vEntryPrefix = struct prefix {
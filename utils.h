@@ -139,6 +139,20 @@ static inline int rmdir(const std::string &path) {
 static inline int rmfile(const std::string &path) {
     return ::unlink(path.c_str());
 }
+/**
+ * Force the data of a file to the disk
+ * @param path file to be synced.
+ * @return 0 if synced successfully, -1 otherwise.
+ */
+static inline int syncFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = ::fdatasync(fd);
+    ::close(fd);
+    return ret;
+}
 static inline void rmDirRecursively(const std::string &path) {
     std::vector<std::string> ret;
     scanDir(path, ret);
@@ -231,31 +245,117 @@ static inline std::unique_ptr<uint16_t[]> generate_crc16_table() {
 /**
  * generate crc16
  * @param data binary data used to generate crc16.
+ * @param length bytes of data.
  * @return generated crc16.
  */
-static inline uint16_t crc16(const std::vector<unsigned char> &data) {
+static inline uint16_t crc16(const unsigned char *data, u64 length) {
     static const std::unique_ptr<uint16_t[]> crc16_table =
         generate_crc16_table();
     uint16_t crc = 0xFFFF;
-    u64 i = 0, length = data.size();
+    u64 i = 0;
     while (i < length) {
         crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ data[i++]) & 0xFF];
     }
     return crc;
 }
+static inline uint16_t crc16(const std::vector<unsigned char> &data) {
+    return crc16(data.data(), data.size());
+}
+static inline std::unique_ptr<uint32_t[]> generate_crc32_table() {
+    std::unique_ptr<uint32_t[]> table(new uint32_t[256]{0});
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t value = i;
+        for (int j = 0; j < 8; j++) {
+            value = (value & 1) ? (value >> 1) ^ 0xEDB88320U : value >> 1;
+        }
+        table[i] = value;
+    }
+    return table;
+}
+/**
+ * generate crc32 (the reflected IEEE polynomial, as zlib)
+ * @param data binary data used to generate crc32.
+ * @param length bytes of data.
+ * @return generated crc32.
+ */
+static inline uint32_t crc32(const void *data, u64 length) {
+    static const std::unique_ptr<uint32_t[]> crc32_table =
+        generate_crc32_table();
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    uint32_t crc = 0xFFFFFFFFU;
+    for (u64 i = 0; i < length; ++i) {
+        crc = (crc >> 8) ^ crc32_table[(crc ^ bytes[i]) & 0xFF];
+    }
+    return crc ^ 0xFFFFFFFFU;
+}
+/**
+@brief append v as a varint (7 bits a byte, low bits first, the top bit set
+on every byte but the last)
+ */
+static inline void putVarint64(TBytes &dst, u64 v) {
+    while (v >= 0x80) {
+        dst.push_back(static_cast<u8>(v) | 0x80);
+        v >>= 7;
+    }
+    dst.push_back(static_cast<u8>(v));
+}
+/**
+@brief decode a varint from [p, end)
+ * @return const u8* past the varint, nullptr if it is cut off or too long
+ */
+static inline const u8 *getVarint64(const u8 *p, const u8 *end, u64 &value) {
+    if (p < end && *p < 0x80) [[likely]] {
+        value = *p;
+        return p + 1;
+    }
+    if (end - p >= 8) {
+        // NOTE: word at a time, the first byte with a clear top bit ends it
+        u64 word;
+        std::memcpy(&word, p, sizeof(word));
+        u64 stops = ~word & 0x8080808080808080ULL;
+        if (stops != 0) {
+            int len = __builtin_ctzll(stops) / 8 + 1;
+            u64 v = 0;
+            for (int i = 0; i < len; ++i) {
+                v |= ((word >> (8 * i)) & 0x7f) << (7 * i);
+            }
+            value = v;
+            return p + len;
+        }
+    }
+    u64 v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        u8 byte = *p++;
+        v |= static_cast<u64>(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            value = v;
+            return p;
+        }
+    }
+    return nullptr;
+}
 /**
 @brief K-ways merge
  * @param  src sorted by the priority(keep the highest priority element at
 begin!)
  * @param  dst
+ * @param  dropped if set, the filtered older kEntrys are appended
  */
-static inline void mergeKSorted(const std::vector<kEntrys> &src, kEntrys &dst) {
+static inline void mergeKSorted(const std::vector<kEntrys> &src, kEntrys &dst,
+                                kEntrys *dropped = nullptr) {
     // NOTE: src is sorted by the priority(keep the priority highest at begin!)
     // priority: the time
     // memtable > l0 > l1 > l2 > ..., in the same layer the index is the
     // priority e.g. l0 sst2 < l0 sst4 HINT：use priority queue
+    // NOTE: equal keys are ordered by the index of their source, not by the
+    // offset, the offsets of different vlog streams do not compare
 
-    std::priority_queue<kEntry> pq;
+    using Item = std::pair<kEntry, int>; // {kEntry, index of the source}
+    auto lower = [](const Item &a, const Item &b) {
+        return a.first.key > b.first.key ||
+               (a.first.key == b.first.key && a.second > b.second);
+    };
+    std::priority_queue<Item, std::vector<Item>, decltype(lower)> pq(lower);
     int K = src.size();
     std::vector<size_t> limitK(K, 0);
     for (int i = 0; i < K; ++i) {
@@ -264,7 +364,7 @@ static inline void mergeKSorted(const std::vector<kEntrys> &src, kEntrys &dst) {
     std::vector<size_t> index(K, 0);
     for (int i = 0; i < K; ++i) {
         if (!src[i].empty()) {
-            pq.push(src[i].front());
+            pq.push({src[i].front(), i});
             index[i]++;
         }
     }
@@ -272,18 +372,21 @@ static inline void mergeKSorted(const std::vector<kEntrys> &src, kEntrys &dst) {
     // the first key == init lastkey and make the pq reduce to 0
     int call_num = 0;
     while (!pq.empty()) {
-        auto top = pq.top();
+        auto top = pq.top().first;
         pq.pop();
         if (top.key == lastKey && call_num != 0) {
             // NOTE: repeat element should be filtered
             // NOTE: the lastKey's init value shouldn't cause affect
+            if (dropped != nullptr) {
+                dropped->push_back(top);
+            }
             continue;
         }
         dst.push_back(top);
         int i = 0;
         for (; i < K; ++i) {
             if (index[i] < limitK[i]) [[likely]] {
-                pq.push(src[i][index[i]]);
+                pq.push({src[i][index[i]], i});
                 index[i]++;
             }
         }
@@ -1,152 +1,633 @@
 #include "vlog.h"
+#include "config.h"
 #include "type.h"
 #include "utils.h"
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <unistd.h>
 #include <vector>
 const u8 vLogs::magic = 0xff;
+namespace {
+// NOTE: magic + checksum + key + vlen
+constexpr size_t prefix_size =
+    sizeof(TMagic) + sizeof(TCheckSum) + sizeof(TKey) + sizeof(TLen);
+// HINT: one pread covers the prefix and a value up to this size
+constexpr size_t read_guess = 256;
+// NOTE: segment files are named by their start offset, zero-padded so the
+// names sort like the offsets
+constexpr size_t segment_name_width = 20;
+const char *const segment_suffix = ".vlog";
+// NOTE: the checkpoint of the head and the tail, next to the vlog file or in
+// the directory of a segmented vlog
+const char *const checkpoint_suffix = ".ckpt";
+const char *const manifest_name = "MANIFEST";
 /**
- * @brief  locate back if failed, read to next magic and do some check
- * @param  ifs
+@brief pread until len bytes are read or the end of file
+ * @return size_t the bytes read
+ */
+size_t pread_full(int fd, u8 *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::pread(fd, buf + done, len - done, offset + done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+// NOTE: the most bytes a batch mode group logs with one write
+constexpr u64 max_group_bytes = 1 << 20;
+/**
+@brief write until all len bytes are written, a write interrupted by a
+signal is retried
+ * @return bool false if a write failed, part of the bytes may be written
+ */
+bool write_full(int fd, const u8 *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::write(fd, buf + done, len - done);
+        if (n < 0) [[unlikely]] {
+            if (errno == EINTR) {
+                continue;
+            }
+            Log("vlog: write failed, error=%s", std::strerror(errno));
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+} // namespace
+/**
+ * @brief  decode the vEntry at offset
+ * @param  offset
  * @param  ve
- * @return -1 if failed, 0 if success
+ * @param  buf reusable read buffer
+ * @return u64 the size of the entry, 0 if there is no valid entry
  */
-int read_a_ventry(std::ifstream &ifs, vEntry &ve) {
-    // read bytes
-    TMagic magic;
+u64 vLogs::decode(TOff offset, vEntry &ve, std::vector<u8> &buf) const {
+    buf.resize(prefix_size + read_guess);
+    size_t n = readAt(offset, buf.data(), buf.size());
+    if (n < prefix_size || buf[0] != vLogs::magic) {
+        return 0;
+    }
     TCheckSum checksum;
     TKey key;
     TLen vlen;
-    TValue value;
-    auto back_loc = ifs.tellg();
-
-    ifs.read(reinterpret_cast<char *>(&magic), sizeof(magic));
-    if (magic != vLogs::magic) {
-        ifs.seekg(back_loc);
-        return -1;
-    }
-    // ...
-    ifs.read(reinterpret_cast<char *>(&checksum), sizeof(checksum));
-    ifs.read(reinterpret_cast<char *>(&key), sizeof(key));
-    ifs.read(reinterpret_cast<char *>(&vlen), sizeof(vlen));
-    // HINT: an incorrect vlen can cause a crash here
-    // SO USE next magic to act as end symbol
-    // TBytes data(vlen);
-    std::vector<u8> data;
-    unsigned char byte;
-    ifs.read(reinterpret_cast<char *>(&byte), sizeof(byte));
-    while (byte != vLogs::magic && !ifs.eof() && !ifs.fail()) {
-        data.push_back(byte);
-        ifs.read(reinterpret_cast<char *>(&byte), sizeof(byte));
-    }
-    if (data.size() != vlen || (ifs.fail() && !ifs.eof())) {
-        ifs.seekg(back_loc);
-        return -1;
-    }
-    if (byte == vLogs::magic) {
-        // HINT: set the ifs back 1
-        ifs.seekg(-1, std::ios_base::cur);
+    std::memcpy(&checksum, buf.data() + sizeof(TMagic), sizeof(checksum));
+    std::memcpy(&key, buf.data() + sizeof(TMagic) + sizeof(checksum),
+                sizeof(key));
+    std::memcpy(&vlen,
+                buf.data() + sizeof(TMagic) + sizeof(checksum) + sizeof(key),
+                sizeof(vlen));
+    if (offset + prefix_size + vlen > head) {
+        // HINT: a corrupted vlen, the entry can not end beyond the head
+        return 0;
     }
-
-    TValue ret(data.begin(), data.end());
-    ve.magic = magic;
+    size_t need = prefix_size + vlen;
+    if (n == buf.size() && need > n) {
+        buf.resize(need);
+        n += readAt(offset + n, buf.data() + n, need - n);
+    }
+    if (n < prefix_size + vlen) {
+        return 0;
+    }
+    // NOTE: the crc covers key + vlen + value, a bad vlen or a torn entry
+    // fails here
+    constexpr size_t crc_begin = sizeof(TMagic) + sizeof(TCheckSum);
+    if (utils::crc16(buf.data() + crc_begin, prefix_size - crc_begin + vlen) !=
+        checksum) {
+        return 0;
+    }
+    auto value_begin = buf.begin() + prefix_size;
+    auto value_end = value_begin + vlen;
+    ve.magic = vLogs::magic;
     ve.checksum = checksum;
     ve.key = key;
     ve.vlen = vlen;
-    ve.vvalue = ret;
-    return 0;
+    ve.vvalue.assign(value_begin, value_end);
+    return prefix_size + vlen;
+}
+/**
+@brief pread from the segment holding offset, the read stops at the end of
+the segment
+ * @return size_t the bytes read
+ */
+size_t vLogs::readAt(TOff offset, u8 *buf, size_t len) const {
+    std::shared_lock lock(seg_mtx);
+    auto it = segments.upper_bound(offset);
+    if (it == segments.begin()) {
+        // HINT: before the first segment, already reclaimed
+        return 0;
+    }
+    --it;
+    return pread_full(it->second, buf, len, offset - it->first);
+}
+/**
+@brief the file of the segment starting at start
+ */
+TPath vLogs::segmentFile(TOff start) const {
+    if (segment_size == 0) {
+        return vfilepath;
+    }
+    std::string name = std::to_string(start);
+    name.insert(0, segment_name_width - std::min(segment_name_width,
+                                                 name.size()),
+                '0');
+    return vfilepath / (name + segment_suffix);
+}
+/**
+@brief the file holding the offset
+ */
+TPath vLogs::segmentPath(TOff offset) const {
+    std::shared_lock lock(seg_mtx);
+    auto it = segments.upper_bound(offset);
+    return segmentFile(it == segments.begin() ? 0 : std::prev(it)->first);
+}
+size_t vLogs::segmentNum() const {
+    std::shared_lock lock(seg_mtx);
+    return segments.size();
+}
+/**
+@brief open the read descriptor of a segment, create the file if needed
+ */
+void vLogs::addSegment(TOff start) {
+    auto path = segmentFile(start);
+    int fd = ::open(path.c_str(), O_RDONLY | O_CREAT, 0644);
+    if (fd < 0) [[unlikely]] {
+        Log("Failed to open vlog, vpath=%s, error=%s", path.c_str(),
+            std::strerror(errno));
+    }
+    std::unique_lock lock(seg_mtx);
+    segments[start] = fd;
+}
+/**
+@brief start a new segment at the head, append_mtx should be held
+ */
+void vLogs::rollSegment() {
+    TOff start = head;
+    addSegment(start);
+    int fd = ::open(segmentFile(start).c_str(), O_WRONLY | O_APPEND, 0644);
+    if (fd < 0) [[unlikely]] {
+        Log("Failed to open vlog, vpath=%s, error=%s",
+            segmentFile(start).c_str(), std::strerror(errno));
+        return;
+    }
+    std::lock_guard lock(sync_mtx);
+    if (sync_mode != config::SyncMode::none && append_fd >= 0) {
+        // HINT: the unsynced tail of the old segment goes with its descriptor
+        ::fdatasync(append_fd);
+    }
+    if (append_fd >= 0) {
+        ::close(append_fd);
+    }
+    append_fd = fd;
+    active_start = start;
+}
+/**
+@brief delete the segments wholly behind the tail, the last one is kept
+ */
+void vLogs::dropSegments() {
+    std::unique_lock lock(seg_mtx);
+    while (segments.size() > 1 && std::next(segments.begin())->first <= tail) {
+        auto it = segments.begin();
+        if (it->second >= 0) {
+            ::close(it->second);
+        }
+        utils::rmfile(segmentFile(it->first));
+        segments.erase(it);
+    }
+}
+TPath vLogs::checkpointPath() const {
+    if (segment_size == 0) {
+        auto path = vfilepath;
+        path += checkpoint_suffix;
+        return path;
+    }
+    return vfilepath / manifest_name;
+}
+/**
+@brief persist the tail and the head, so opening the vlog needs no scan.
+Called on flush, gc, clear and close
+ */
+void vLogs::checkpoint() {
+    std::lock_guard lock(ckpt_mtx);
+    auto path = checkpointPath();
+    auto tmp_path = path;
+    tmp_path += ".tmp";
+    std::ofstream ofs(tmp_path, std::ios::out | std::ios::trunc);
+    if (!ofs.is_open()) {
+        // HINT: the directory is gone (kvstore reset), clear writes it again
+        return;
+    }
+    // HINT: a head read between two appends is always an entry boundary
+    ofs << tail.load() << ' ' << head.load();
+    ofs.close();
+    if (sync_mode != config::SyncMode::none) {
+        utils::syncFile(tmp_path);
+    }
+    // HINT: rename replaces the old manifest atomically
+    std::filesystem::rename(tmp_path, path);
+}
+/**
+@brief open the long-lived descriptors, create the file (or the first
+segment) if needed
+ */
+void vLogs::openFiles() {
+    if (segment_size == 0) {
+        addSegment(0);
+    } else {
+        std::error_code ec;
+        std::filesystem::create_directories(vfilepath, ec);
+        for (const auto &entry :
+             std::filesystem::directory_iterator(vfilepath, ec)) {
+            auto name = entry.path().filename().string();
+            if (name.ends_with(segment_suffix)) {
+                addSegment(std::stoull(name));
+            }
+        }
+        if (segments.empty()) {
+            addSegment(0);
+        }
+    }
+    active_start = segments.rbegin()->first;
+    append_fd = ::open(segmentFile(active_start).c_str(),
+                       O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (append_fd < 0) [[unlikely]] {
+        Log("Failed to open vlog, vpath=%s, error=%s", vfilepath.c_str(),
+            std::strerror(errno));
+    }
+}
+void vLogs::closeFiles() {
+    if (append_fd >= 0) {
+        ::close(append_fd);
+    }
+    append_fd = -1;
+    std::unique_lock lock(seg_mtx);
+    for (auto [start, fd] : segments) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    segments.clear();
+}
+/**
+@brief set the head and the tail from the checkpoint, validated against the
+files. Without a usable checkpoint the tail is searched as before
+ */
+void vLogs::loadBounds() {
+    off_t size = ::lseek(segments.rbegin()->second, 0, SEEK_END);
+    if (size < 0) {
+        Log("Failed to open file, vpath=%s, error=%s", vfilepath.c_str(),
+            std::strerror(errno));
+        head = 0;
+        tail = 0;
+        return;
+    }
+    // NOTE: the head is where the last segment ends
+    TOff end = active_start + size;
+    head = end;
+    TOff saved_tail = 0;
+    TOff saved_head = 0;
+    std::ifstream ifs(checkpointPath());
+    bool saved = static_cast<bool>(ifs >> saved_tail >> saved_head);
+    ifs.close();
+    bool stale = !saved || saved_tail > saved_head || saved_head > end;
+    // HINT: a stale checkpoint (or none), fall back to the scan
+    tail = stale ? 0 : saved_tail;
+    // NOTE: relocTail only searches when the tail is not at an entry
+    this->relocTail();
+    if (stale) {
+        // HINT: every entry may be unchecked, walk them all from the tail
+        saved_head = tail;
+    }
+    if (segment_size != 0) {
+        // HINT: gc may have died between the checkpoint and the deletes
+        dropSegments();
+    }
+    // NOTE: walk the entries appended after the checkpoint, a crash may have
+    // torn the last one
+    thread_local std::vector<u8> buf;
+    vEntry ve;
+    TOff pos = saved_head;
+    while (pos < end) {
+        u64 n = decode(pos, ve, buf);
+        if (n == 0) {
+            break;
+        }
+        pos += n;
+    }
+    if (pos < end && pos >= active_start && resync(pos + 1) == end) {
+        // HINT: nothing valid behind it, cut it so appends go on after the
+        // last entry
+        if (::ftruncate(append_fd, pos - active_start) == 0) {
+            Log("vlog: cut %lu torn bytes at %lu", end - pos, pos);
+            head = pos;
+        }
+    }
 }
-vLogs::vLogs(const TPath &vpath) : vfilepath(vpath) {
+vLogs::vLogs(const TPath &vpath)
+    : vfilepath(vpath), segment_size(config::vlog_segment_size),
+      append_fd(-1), active_start(0), value_cache(config::value_cache_size),
+      dead_total(0),
+      sync_mode(config::sync_mode), unsynced(0), syncs(0), stop_sync(false) {
     // HINT: magic number is used for find the head(because the head and the
     // tail won't be persistent), 0x7f HINT: checksum is the crc16 value
     // calculated by {key, vlen, vvalue} HINT: saved key for gc check if can
     // open file
     head = 0;
     tail = 0;
-    if (!std::filesystem::exists(vpath)) {
-        std::ofstream ofs(vpath, std::ios::binary);
-        ofs.close();
+    openFiles();
+    loadBounds();
+    if (sync_mode == config::SyncMode::periodic) {
+        sync_thread = std::thread(&vLogs::syncLoop, this);
+    }
+}
+vLogs::~vLogs() {
+    if (sync_thread.joinable()) {
+        {
+            std::lock_guard lock(sync_mtx);
+            stop_sync = true;
+        }
+        sync_cv.notify_all();
+        sync_thread.join();
+    }
+    if (sync_mode != config::SyncMode::none) {
+        sync();
+    }
+    checkpoint();
+    closeFiles();
+}
+/**
+@brief force the appended entries to the disk
+ */
+void vLogs::sync() {
+    std::lock_guard lock(sync_mtx);
+    if (append_fd >= 0 && ::fdatasync(append_fd) < 0) [[unlikely]] {
+        Log("vlog: fdatasync failed, error=%s", std::strerror(errno));
+    }
+    unsynced = 0;
+    ++syncs;
+}
+/**
+@brief apply the sync mode to the bytes just appended
+ */
+void vLogs::afterAppend(u64 bytes) {
+    switch (sync_mode) {
+    case config::SyncMode::none:
+        break;
+    case config::SyncMode::batch:
+        // HINT: groupAppend syncs the group it logs
+        break;
+    case config::SyncMode::periodic:
+        if (unsynced.fetch_add(bytes) + bytes >= config::sync_bytes) {
+            sync_cv.notify_one();
+        }
+        break;
+    }
+}
+/**
+@brief the periodic sync thread, wakes up every sync_interval_ms or when
+sync_bytes are unsynced
+ */
+void vLogs::syncLoop() {
+    std::unique_lock lock(sync_mtx);
+    while (!stop_sync) {
+        sync_cv.wait_for(lock,
+                         std::chrono::milliseconds(config::sync_interval_ms));
+        if (unsynced == 0) {
+            continue;
+        }
+        // HINT: the lock keeps clear from swapping the descriptor meanwhile
+        unsynced = 0;
+        ++syncs;
+        if (append_fd >= 0 && ::fdatasync(append_fd) < 0) [[unlikely]] {
+            Log("vlog: fdatasync failed, error=%s", std::strerror(errno));
+        }
+    }
+}
+/**
+@brief write the bytes at the head and apply the sync mode
+ * @return TOff where the bytes begin
+ */
+TOff vLogs::append(const TBytes &bytes) {
+    if (sync_mode == config::SyncMode::batch) {
+        return groupAppend(bytes);
+    }
+    TOff offset;
+    {
+        std::lock_guard lock(append_mtx);
+        offset = appendLocked(bytes);
+    }
+    afterAppend(bytes.size());
+    return offset;
+}
+/**
+@brief write the bytes at the head and move the head past them, append_mtx
+should be held. A failed write is cut off the file and the head stays, so the
+next entry starts where this one would have
+ * @return TOff where the bytes begin
+ */
+TOff vLogs::appendLocked(const TBytes &bytes) {
+    // HINT: a batch goes to one segment, it may end past segment_size
+    if (segment_size != 0 && head - active_start >= segment_size) {
+        rollSegment();
+    }
+    if (!write_full(append_fd, bytes.data(), bytes.size())) [[unlikely]] {
+        std::string msg = "Try to append to vlog(" + vfilepath.string() +
+                          ") failed: " + std::strerror(errno);
+        if (::ftruncate(append_fd, head - active_start) < 0) {
+            Log("vlog: truncate failed, error=%s", std::strerror(errno));
+        }
+        std::cerr << msg << std::endl;
+        throw std::runtime_error(msg);
     }
-    std::ifstream ifs(vpath, std::ios::binary | std::ios::ate);
-    if (ifs.is_open()) {
-        ifs.close();
+    // HINT: head 在前面，gc从tail开始
+    return head.fetch_add(bytes.size());
+}
+/**
+@brief append in batch mode: the puts that come while a leader writes and
+syncs queue up, the first of them leads the next group and logs them all with
+one write and one fdatasync. Each returns once its bytes are synced
+ * @return TOff where the bytes begin
+ */
+TOff vLogs::groupAppend(const TBytes &bytes) {
+    Writer self{.bytes = &bytes};
+    std::unique_lock lock(group_mtx);
+    writers.push_back(&self);
+    while (!self.done && writers.front() != &self) {
+        self.cv.wait(lock);
     }
-    if (ifs.tellg() != 0) {
-        reload_mem();
+    if (self.done) {
+        if (self.error) {
+            std::rethrow_exception(self.error);
+        }
+        return self.offset;
     }
+    // NOTE: the group is the queue up to max_group_bytes, the puts queued
+    // later wait for the next one
+    size_t num = 0;
+    u64 total = 0;
+    for (auto *writer : writers) {
+        if (num > 0 && total + writer->bytes->size() > max_group_bytes) {
+            break;
+        }
+        total += writer->bytes->size();
+        ++num;
+    }
+    std::vector<Writer *> group(writers.begin(), writers.begin() + num);
+    lock.unlock();
+    thread_local TBytes group_bytes;
+    const TBytes *data = &bytes;
+    if (num > 1) {
+        group_bytes.clear();
+        for (auto *writer : group) {
+            group_bytes.insert(group_bytes.end(), writer->bytes->begin(),
+                               writer->bytes->end());
+        }
+        data = &group_bytes;
+    }
+    TOff base = 0;
+    std::exception_ptr error;
+    try {
+        std::lock_guard append_lock(append_mtx);
+        base = appendLocked(*data);
+    } catch (const std::runtime_error &) {
+        // HINT: nothing of the group is logged, every put of it fails
+        error = std::current_exception();
+    }
+    if (!error) {
+        sync();
+    }
+    lock.lock();
+    for (auto *writer : group) {
+        writer->offset = base;
+        base += writer->bytes->size();
+        writer->error = error;
+        writer->done = true;
+        writers.pop_front();
+        if (writer != &self) {
+            writer->cv.notify_one();
+        }
+    }
+    if (!writers.empty()) {
+        writers.front()->cv.notify_one();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return self.offset;
 }
-vLogs::~vLogs() = default;
 /**
-@brief add a value entry to vlog (not change the vlog if the entry is marked
-deleted)
+@brief add a value entry to vlog, an entry marked deleted (vlen 0) is logged
+as a tombstone
  * @param  v
- * @param  sync if sync to vlog file immediately
  * @return TOff the write location in file
  */
 TOff vLogs::addVlog(const vEntryProps &v) {
-    // HINT: add a new vEntry to the ves
-    // HINT: update the tail
-
-    std::fstream fs(vfilepath, std::ios::binary | std::ios::app);
-    if (v.vlen == 0) {
-        // deleted element
-        return fs.tellg();
-    }
     TCheckSum checksum;
-    TBytes bytes = cal_bytes(v, checksum);
+    thread_local TBytes bytes;
+    bytes.clear();
+    append_entry(bytes, v, checksum);
     // std::printf("Checksum of v is: %x\n", checksum);
-    fs.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
-
-    // sync with file
-    fs.flush();
-    fs.close();
-    u64 ret = head;
-    head += bytes.size(); // head 在前面，gc从tail开始
-    return ret;
+    return append(bytes);
 }
 /**
-@brief the tail will be set to the begin the first magic
+@brief add a batch of value entries with a single write
+ * @param  vs the entries, deleted ones (vlen 0) are logged as tombstones
+ * @return std::vector<TOff> the write location of each entry
  */
-void vLogs::relocTail() {
-    std::ifstream ifs(vfilepath, std::ios::binary);
-    if (!ifs.is_open()) {
-        Log("relocTail: Failed to open file");
-        return;
+std::vector<TOff> vLogs::addVlogs(const std::vector<vEntryProps> &vs) {
+    thread_local TBytes bytes;
+    bytes.clear();
+    std::vector<TOff> offsets;
+    offsets.reserve(vs.size());
+    for (const auto &v : vs) {
+        offsets.push_back(bytes.size());
+        TCheckSum checksum;
+        append_entry(bytes, v, checksum);
     }
-    u64 tmp = utils::seek_data_block(vfilepath);
-
-    ifs.seekg(tmp);
-
-    unsigned char byte;
+    if (bytes.empty()) {
+        return offsets;
+    }
+    TOff base = append(bytes);
+    for (auto &offset : offsets) {
+        offset += base;
+    }
+    return offsets;
+}
+/**
+@brief find the first valid entry (magic and crc) in [from, head), used to
+skip a corrupted or punched part of the vlog
+ * @return TOff the offset of the entry, head if there is none
+ */
+TOff vLogs::resync(TOff from) const {
+    thread_local std::vector<u8> chunk;
+    thread_local std::vector<u8> buf;
+    constexpr size_t chunk_size = 4096;
     vEntry ve;
-    TCheckSum cal_checksum;
-    auto back_loc = ifs.tellg();
-    auto last_loc = ifs.tellg();
-    ifs.read(reinterpret_cast<char *>(&byte), sizeof(byte));
-    int suc = -1;
-    // check the checksum
-    while (suc != 0) {
-        while (byte != vLogs::magic && !ifs.eof() && !ifs.fail()) {
-            ifs.read(reinterpret_cast<char *>(&byte), sizeof(byte));
-        }
-        if (ifs.eof() || ifs.fail()) {
-            Log("relocTail: incorrect offset");
-            ifs.seekg(back_loc);
-            return;
+    chunk.resize(chunk_size);
+    // HINT: a read stops at the end of a segment, the next one starts there
+    for (u64 pos = from; pos < head;) {
+        size_t n = readAt(pos, chunk.data(), chunk_size);
+        for (size_t i = 0; i < n && pos + i < head; ++i) {
+            if (chunk[i] == vLogs::magic && decode(pos + i, ve, buf) != 0) {
+                return pos + i;
+            }
         }
-        ifs.seekg(-1, std::ios_base::cur);
-        last_loc = ifs.tellg();
-        suc = read_a_ventry(ifs, ve);
-
-        cal_bytes(ve, cal_checksum);
-        if (suc && cal_checksum == ve.checksum) {
+        if (n == 0) {
             break;
         }
+        pos += n;
     }
-
-    tail = last_loc;
-    std::cout << "reloc to " << tail << std::endl;
+    return head;
+}
+/**
+@brief make sure the tail is at a valid entry. It usually is (gc and the
+checkpoint keep it exact), otherwise the tail is set to the begin of the first
+valid entry after the punched hole
+ */
+void vLogs::relocTail() {
+    TOff first;
+    int fd;
+    {
+        std::shared_lock lock(seg_mtx);
+        first = segments.begin()->first;
+        fd = segments.begin()->second;
+    }
+    if (tail < first) {
+        tail = first;
+    }
+    thread_local std::vector<u8> buf;
+    vEntry ve;
+    if (tail >= head || decode(tail, ve, buf) != 0) {
+        return;
+    }
+    TOff start = tail;
+    if (segment_size == 0) {
+        off_t data = ::lseek(fd, 0, SEEK_DATA);
+        if (data < 0) {
+            Log("relocTail: no data in vlog");
+            return;
+        }
+        start = std::max<TOff>(start, data);
+    }
+    TOff loc = resync(start);
+    if (loc >= head) {
+        Log("relocTail: incorrect offset");
+        return;
+    }
+    tail = loc;
+    Log("reloc to %lu", tail.load());
 }
 /**
 @brief read the first vEntry from vlog
@@ -156,62 +637,43 @@ void vLogs::relocTail() {
 void vLogs::readVlog(TOff offset, vEntry &ve) {
     relocTail();
     // Now the tail is set to the begin of the first valid entry
-    std::ifstream ifs(vfilepath, std::ios::binary);
-    if (!ifs.is_open()) {
-        std::cerr << "In readVlog: Failed to open file" << std::endl;
-        ve = type::ve_not_found;
-    }
-    ifs.seekg(tail);
-    int suc = read_a_ventry(ifs, ve);
-    if (suc == -1) {
+    thread_local std::vector<u8> buf;
+    if (decode(tail, ve, buf) == 0) {
         std::cerr << "readVlog: incorrect offset" << std::endl;
-        ifs.close();
-        return;
+        ve = type::ve_not_found;
     }
-    ifs.close();
 }
 
 /**
 @brief read vEntrys util the read bytes reach the chunk_size
- * @param  offset
+ * @param  offset the entry to start from, the tail if offset is before it
  * @param  ves should be empty
  * @param  chunk_size
+ * @return u64 the bytes read from the start
  */
 u64 vLogs::readVlogs(TOff offset, vEntrys &ves, u64 chunk_size,
                      std::vector<TOff> &locs) {
     relocTail();
     // Now the tail is set to the begin of the first valid entry
-    std::ifstream ifs(vfilepath, std::ios::binary);
-    if (!ifs.is_open()) {
-        Log("In readVlog: Failed to open file");
-        return 0;
-    }
-    vEntry ve;
-    ifs.seekg(tail);
-    locs.push_back(tail);
-    auto begin = ifs.tellg();
+    thread_local std::vector<u8> buf;
+    u64 begin = std::max<u64>(offset, tail);
+    locs.push_back(begin);
     u64 size = 0;
     while (size < chunk_size && size + begin < head) {
-        int suc = read_a_ventry(ifs, ve);
-        if (suc == -1) {
+        vEntry ve;
+        u64 n = decode(begin + size, ve, buf);
+        if (n == 0) {
+            // NOTE: corrupted, skip to the next valid entry. The skipped
+            // bytes are reclaimed with the chunk
             Log("readVlogs: incorrect offset");
-            ifs.close();
-            return 0;
-        }
-        ves.push_back(ve);
-
-        auto cur = ifs.tellg();
-        if (ifs.eof()) {
-            ifs.clear();
-            cur = ifs.seekg(0, std::ios::end).tellg();
+            size = resync(begin + size + 1) - begin;
+            locs.back() = begin + size;
+            continue;
         }
-        // ATTENTION：when read to the end of file, cur's offset will be -1
-        Assert((cur != (uint64_t)(-1)), "Uncaught error in readVlogs");
-        size = cur - begin;
-        locs.push_back(cur);
+        ves.push_back(std::move(ve));
+        size += n;
+        locs.push_back(begin + size);
     }
-    // tail = size + begin;
-    ifs.close();
     return size;
 }
 /**
@@ -221,41 +683,46 @@ u64 vLogs::readVlogs(TOff offset, vEntrys &ves, u64 chunk_size,
  * @return TBytes the bytes generated by vlog entry to write
  */
 TBytes vLogs::cal_bytes(const vEntryProps &v, TCheckSum &checksum) {
-    vEntry new_entry;
+    TBytes bytes;
+    append_entry(bytes, v, checksum);
+    return bytes;
+}
+/**
+@brief serialize the entry at the end of bytes
+ * @param  v vlog entry
+ * @param  checksum crc16
+ */
+void vLogs::append_entry(TBytes &bytes, const vEntryProps &v,
+                         TCheckSum &checksum) {
     TKey key = v.key;
     TLen vlen = v.vlen;
-    TValue vvalue = v.vvalue;
-    new_entry.key = key;
-    new_entry.vlen = vlen;
-    new_entry.vvalue = vvalue;
-
-    TBytes bytes;
-    bytes.push_back(magic);
     constexpr static int keysize = sizeof(decltype(key));
     constexpr static int lensize = sizeof(decltype(vlen));
-    std::vector<u8> data;
     const u8 mask = 0xff;
+    size_t begin = bytes.size();
+    bytes.reserve(begin + prefix_size + v.vvalue.size());
+    bytes.push_back(magic);
+    // HINT: the checksum is filled in once the data is in place
+    bytes.resize(bytes.size() + sizeof(checksum));
+    size_t data_begin = bytes.size();
     for (int i = 0; i < keysize; ++i) {
         // little-endian
         u8 byte = (key >> (8 * i)) & mask;
-        data.push_back(byte);
+        bytes.push_back(byte);
     }
     for (int i = 0; i < lensize; ++i) {
         // little-endian
         u8 byte = (vlen >> (8 * i)) & mask;
-        data.push_back(byte);
+        bytes.push_back(byte);
     }
-    data.insert(data.end(), vvalue.begin(), vvalue.end());
-    checksum = utils::crc16(data);
+    bytes.insert(bytes.end(), v.vvalue.begin(), v.vvalue.end());
+    checksum =
+        utils::crc16(bytes.data() + data_begin, bytes.size() - data_begin);
 
-    for (int i = 0; i < sizeof(checksum); ++i) {
+    for (size_t i = 0; i < sizeof(checksum); ++i) {
         // little-endian
-        u8 byte = (checksum >> (8 * i)) & mask;
-        bytes.push_back(byte);
+        bytes[begin + sizeof(TMagic) + i] = (checksum >> (8 * i)) & mask;
     }
-
-    bytes.insert(bytes.end(), data.begin(), data.end());
-    return bytes;
 }
 /**
 @brief
@@ -271,39 +738,39 @@ inline TBytes vLogs::cal_bytes(const vEntry &v, TCheckSum &checksum) {
  */
 void vLogs::clear() {
     ves.clear();
+    value_cache.clear();
+    clearDead();
     head = 0;
     tail = 0;
-    if (!std::filesystem::exists(vfilepath)) {
-        return;
+    // HINT: the file may be removed with its directory (kvstore reset)
+    std::lock_guard lock(sync_mtx);
+    closeFiles();
+    if (segment_size == 0) {
+        int fd = ::open(vfilepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    } else {
+        std::error_code ec;
+        std::filesystem::remove_all(vfilepath, ec);
     }
-    std::ofstream ofs(vfilepath, std::ios::binary | std::ios::trunc);
-    ofs.close();
+    openFiles();
+    unsynced = 0;
+    checkpoint();
 }
 void vLogs::clear_mem() {
     ves.clear();
+    value_cache.clear();
+    clearDead();
     head = 0;
     tail = 0;
 }
 void vLogs::reload_mem() {
-    std::ifstream ifs(vfilepath,
-                      std::ios::binary | std::ios::ate); // move to end
-    if (!ifs.is_open()) {
-        int errCode = errno; // get the errno
-        const char *errMsg =
-            std::strerror(errCode); // convert errno to error message
-        Log("Failed to open file, vpath=%s, error=%s", vfilepath.c_str(),
-            errMsg);
-        head = 0;
-        tail = 0;
-        return;
-    }
-    head = ifs.tellg();
-    if (head == 0) {
-        tail = 0;
-        return;
-    }
-    this->relocTail();
-    ifs.close();
+    // HINT: reopen, the segments may have changed on disk
+    std::lock_guard lock(sync_mtx);
+    closeFiles();
+    openFiles();
+    loadBounds();
 }
 /**
 @brief
@@ -311,24 +778,26 @@ void vLogs::reload_mem() {
  * @return TValue "" if fail or deleted. Otherwise, return the value
  */
 TValue vLogs::query(kEntry ke) {
-    if (ke.offset > head || ke.offset < tail || ke.len == 0) {
-        return "";
-    }
-    std::ifstream ifs(vfilepath, std::ios::binary);
-    if (!ifs.is_open()) [[unlikely]] {
+    if (ke.offset >= head || ke.offset < tail || ke.len == 0) {
         return "";
     }
-    ifs.seekg(ke.offset);
-    if (ifs.fail()) {
-        ifs.clear();
-        ifs.close();
-        return "";
+    // HINT: a disabled cache takes no shard lock and counts no miss
+    bool cached = value_cache.getCapacity() > 0;
+    if (cached) {
+        if (auto value = value_cache.lookup(ke.offset)) {
+            return *value;
+        }
     }
+    // NOTE: every reader thread decodes into its own buffer
+    thread_local std::vector<u8> buf;
     vEntry ve;
-    int success = read_a_ventry(ifs, ve);
-    ifs.close();
-    if (success == -1)
+    if (decode(ke.offset, ve, buf) == 0) {
         return "";
+    }
+    if (cached) {
+        value_cache.insert(ke.offset, std::make_shared<TValue>(ve.vvalue),
+                           ve.vvalue.size() + sizeof(TValue) + sizeof(TOff));
+    }
     return ve.vvalue;
 }
 
@@ -339,7 +808,95 @@ void vLogs::gc(u64 new_tail) {
         return;
     }
 
-    utils::de_alloc_file(vfilepath, tail, new_tail - tail);
-    std::cout << "gc done, new tail is " << new_tail << std::endl;
-    tail = new_tail;
+    TOff old_tail = tail;
+    if (segment_size == 0) {
+        utils::de_alloc_file(vfilepath, tail, new_tail - tail);
+        tail = new_tail;
+        checkpoint();
+    } else {
+        // NOTE: persist the tail first, a crash then leaves at most some
+        // segments to delete on the next start
+        tail = new_tail;
+        checkpoint();
+        dropSegments();
+    }
+    {
+        std::lock_guard lock(dead_mtx);
+        const u64 region_size = config::gc_region_size;
+        u64 region = new_tail / region_size;
+        auto end = dead_bytes.lower_bound(region);
+        for (auto it = dead_bytes.begin(); it != end; ++it) {
+            dead_total -= it->second;
+        }
+        dead_bytes.erase(dead_bytes.begin(), end);
+        // NOTE: the region the tail stops in keeps the share of its count
+        // that is still ahead of the tail. The dead entries are not counted
+        // by position, they are taken as spread evenly over the region
+        if (end != dead_bytes.end() && end->first == region) {
+            TOff from = std::max<TOff>(old_tail, region * region_size);
+            TOff to = (region + 1) * region_size;
+            u64 kept = static_cast<u64>(static_cast<double>(end->second) *
+                                        (to - new_tail) / (to - from));
+            dead_total -= end->second - kept;
+            end->second = kept;
+        }
+    }
+    Log("gc done, new tail is %lu", new_tail);
+}
+void vLogs::clearDead() {
+    std::lock_guard lock(dead_mtx);
+    dead_bytes.clear();
+    dead_total = 0;
+}
+/**
+@brief count the entry at offset as garbage
+ * @param  len the vlen of the entry (0 for a tombstone)
+ */
+void vLogs::markDead(TOff offset, TLen len) {
+    if (offset < tail || offset >= head) {
+        // HINT: already reclaimed
+        return;
+    }
+    std::lock_guard lock(dead_mtx);
+    dead_bytes[offset / config::gc_region_size] += prefix_size + len;
+    dead_total += prefix_size + len;
+}
+u64 vLogs::deadBytes() const {
+    std::lock_guard lock(dead_mtx);
+    return dead_total;
+}
+/**
+@brief pick the chunk a gc should reclaim. The vlog is reclaimed from the
+tail, so the candidates are the prefixes [tail, end of region i) of the
+first max_regions regions, the densest one wins
+ * @param  min_ratio the dead ratio a chunk needs
+ * @return u64 the chunk size, 0 if no chunk is dense enough
+ */
+u64 vLogs::gcChunk(double min_ratio, size_t max_regions) const {
+    TOff from = tail;
+    TOff to = head;
+    const u64 region_size = config::gc_region_size;
+    std::lock_guard lock(dead_mtx);
+    if (from >= to || dead_total < min_ratio * (to - from)) {
+        return 0;
+    }
+    u64 best = 0;
+    double best_ratio = min_ratio;
+    u64 dead = 0;
+    u64 region = from / region_size;
+    for (size_t i = 0; i < max_regions; ++i, ++region) {
+        TOff end = std::min<TOff>((region + 1) * region_size, to);
+        if (auto it = dead_bytes.find(region); it != dead_bytes.end()) {
+            dead += it->second;
+        }
+        double ratio = static_cast<double>(dead) / (end - from);
+        if (ratio >= best_ratio) {
+            best_ratio = ratio;
+            best = end - from;
+        }
+        if (end == to) {
+            break;
+        }
+    }
+    return best;
 }
\ No newline at end of file
@@ -1,39 +1,138 @@
 #ifndef __VLOG_H__
 #define __VLOG_H__
+#include "cache.h"
+#include "config.h"
 #include "type.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+// NOTE: the offsets into a cold stream (the live values gc moved) carry this
+// bit, the rest of the offset is the position in that stream
+constexpr TOff vlog_cold_flag = 1ULL << 63;
 class vLogs {
   private:
     // TBytes data;
 
-    u64 head;
-    u64 tail;
+    // NOTE: query reads them without the kvstore layer lock, while the flush
+    // thread appends at the head
+    std::atomic<u64> head;
+    std::atomic<u64> tail;
 
     TPath vfilepath;
+    // NOTE: fixed at construction from config::vlog_segment_size. 0 keeps the
+    // vlog in the single file vfilepath, reclaimed by punching holes.
+    // Otherwise vfilepath is a directory of segment files named by the offset
+    // they start at, a new one is started once the last one holds
+    // segment_size bytes and gc deletes the ones behind the tail
+    const u64 segment_size;
+    // NOTE: long-lived descriptors, appends go through append_fd (O_APPEND,
+    // the last segment) and every read is a pread on the read descriptor of
+    // its segment, so readers share no stream state
+    int append_fd;
+    TOff active_start; // NOTE: the start of the last segment, by append_mtx
+    // NOTE: segment start -> read descriptor. The segments are contiguous,
+    // one starts where the previous one ends, and an entry never spans two
+    std::map<TOff, int> segments;
+    // NOTE: guards segments, shared by the reads, exclusive when a segment is
+    // added or removed
+    mutable std::shared_mutex seg_mtx;
+    // NOTE: values by offset, filled by query. An offset is never reused
+    // until the vlog is cleared, and gc only moves the tail (checked first)
+    ShardedLRUCache<TOff, TValue> value_cache;
+    // NOTE: dead bytes by region (offset / gc_region_size), counted when
+    // compaction drops an overwritten kEntry and forgotten once the tail
+    // passes the region. Kept in memory only, a reopened vlog counts anew
+    std::map<u64, u64> dead_bytes;
+    u64 dead_total;
+    mutable std::mutex dead_mtx;
+    // NOTE: fixed at construction from config::sync_mode
+    const config::SyncMode sync_mode;
+    std::atomic<u64> unsynced; // bytes appended since the last fdatasync
+    std::atomic<u64> syncs;    // fdatasyncs of the appends so far
+    // NOTE: an append writes and moves the head as one step, puts log their
+    // entries from many threads
+    std::mutex append_mtx;
+    // NOTE: batch mode group commit. The appends wait in writers, the front
+    // one leads: it logs the bytes of all queued ones with one write and one
+    // fdatasync, then hands each its offset
+    struct Writer {
+        const TBytes *bytes;
+        TOff offset = 0;
+        bool done = false;
+        std::exception_ptr error; // the append of the group failed
+        std::condition_variable cv;
+    };
+    std::deque<Writer *> writers;
+    std::mutex group_mtx;
+    // NOTE: guards the descriptors against the sync thread while clear
+    // reopens them, and stop_sync
+    std::mutex sync_mtx;
+    std::condition_variable sync_cv;
+    std::mutex ckpt_mtx; // NOTE: one checkpoint writer at a time
+    bool stop_sync;
+    std::thread sync_thread; // periodic mode only
+
+    void openFiles();
+    void closeFiles();
+    void loadBounds();
+    void addSegment(TOff start);
+    void rollSegment();
+    void dropSegments();
+    size_t readAt(TOff offset, u8 *buf, size_t len) const;
+    [[nodiscard]] TPath segmentFile(TOff start) const;
+    [[nodiscard]] TPath checkpointPath() const;
+    void clearDead();
+    void afterAppend(u64 bytes);
+    TOff append(const TBytes &bytes);
+    TOff groupAppend(const TBytes &bytes);
+    TOff appendLocked(const TBytes &bytes);
+    void syncLoop();
+    u64 decode(TOff offset, vEntry &ve, std::vector<u8> &buf) const;
+    TOff resync(TOff from) const;
 
   public:
-    // TODO: add vlog cache
     static const u8 magic;
     static TBytes cal_bytes(const vEntryProps &v, TCheckSum &checksum);
     static TBytes cal_bytes(const vEntry &v, TCheckSum &checksum);
+    static void append_entry(TBytes &bytes, const vEntryProps &v,
+                             TCheckSum &checksum);
     vEntrys ves;
     // vEntry:{char magic, uint16 checksum, uint32 vlen, uint64 value}
 
     // methods
     vLogs(const TPath &vpath);
+    vLogs(const vLogs &other) = delete;
+    vLogs &operator=(const vLogs &other) = delete;
     void relocTail();
     TOff addVlog(const vEntryProps &v); // ret: the offset of the add vlog
+    std::vector<TOff> addVlogs(const std::vector<vEntryProps> &vs);
     TValue query(kEntry ke);
     void clear();
+    void sync();
+    void checkpoint();
     void clear_mem();
     void reload_mem();
     void gc(u64 new_tail);
+    void markDead(TOff offset, TLen len);
+    [[nodiscard]] u64 deadBytes() const;
+    [[nodiscard]] u64 gcChunk(double min_ratio, size_t max_regions) const;
     void readVlog(TOff offset, vEntry &ve);
     u64 readVlogs(TOff offset, vEntrys &ves, u64 chunk_size,
                   std::vector<TOff> &locs);
     [[nodiscard]] u64 getHead() const { return head; }
     [[nodiscard]] u64 getTail() const { return tail; }
+    [[nodiscard]] u64 syncNum() const { return syncs; }
     [[nodiscard]] u8 getMagic() const { return magic; }
     [[nodiscard]] std::string getPath() const { return vfilepath; }
+    [[nodiscard]] TPath segmentPath(TOff offset) const;
+    [[nodiscard]] size_t segmentNum() const;
+    ShardedLRUCache<TOff, TValue> &valueCache() { return value_cache; }
     ~vLogs();
 };
 #endif
\ No newline at end of file